@@ -0,0 +1,235 @@
+#include "bondframes.h"
+#include <QtConcurrentMap>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// bonds per task
+static const int rangeSize = 16384;
+
+struct Range
+{
+    int first, last;
+};
+
+// SoA buffers of one range: inputs a, d = b - a; outputs u (offset
+// direction, the cylinder's x axis) and v = n x u (the cylinder's y axis)
+struct FrameBuffers
+{
+    QVector<float> ax, ay, az, dx, dy, dz;
+    QVector<float> ux, uy, uz, vx, vy, vz;
+
+    void resize(int n)
+    {
+        QVector<float> * all[] = { &ax, &ay, &az, &dx, &dy, &dz, &ux, &uy, &uz, &vx, &vy, &vz };
+        for (int k = 0; k < 12; ++k)
+            all[k]->resize(n);
+    }
+};
+
+static inline void frame(FrameBuffers & f, int i)
+{
+    float len2 = f.dx[i]*f.dx[i] + f.dy[i]*f.dy[i] + f.dz[i]*f.dz[i];
+    float keep = (len2 > 1.0e-16f) ? 1 : 0;
+    float inv = 1 / sqrtf(qMax(len2, 1.0e-30f));
+    float nx = f.dx[i] * inv, ny = f.dy[i] * inv, nz = f.dz[i] * inv;
+
+    // |up - (up.n) n|^2 = 1 - ny^2 for up = (0, 1, 0)
+    float r2 = 1 - ny*ny;
+    float ux, uy, uz;
+    if (r2 < 1.0e-12f)
+    {
+        ux = -ny; uy = 0; uz = 0;
+    }
+    else
+    {
+        float s = 1 / sqrtf(r2);
+        ux = -ny*nx * s; uy = r2 * s; uz = -ny*nz * s;
+    }
+
+    f.ux[i] = ux * keep; f.uy[i] = uy * keep; f.uz[i] = uz * keep;
+    f.vx[i] = (ny*uz - nz*uy) * keep;
+    f.vy[i] = (nz*ux - nx*uz) * keep;
+    f.vz[i] = (nx*uy - ny*ux) * keep;
+    f.dx[i] *= keep; f.dy[i] *= keep; f.dz[i] *= keep;
+}
+
+#ifdef __SSE2__
+static inline __m128 select(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// the same as frame(), for bonds i .. i + 3
+static inline void frame4(FrameBuffers & f, int i)
+{
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 zero = _mm_setzero_ps();
+
+    __m128 dx = _mm_loadu_ps(&f.dx[i]), dy = _mm_loadu_ps(&f.dy[i]), dz = _mm_loadu_ps(&f.dz[i]);
+    __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+    __m128 keep = _mm_cmpgt_ps(len2, _mm_set1_ps(1.0e-16f));
+    __m128 inv = _mm_div_ps(one, _mm_sqrt_ps(_mm_max_ps(len2, _mm_set1_ps(1.0e-30f))));
+    __m128 nx = _mm_mul_ps(dx, inv), ny = _mm_mul_ps(dy, inv), nz = _mm_mul_ps(dz, inv);
+
+    __m128 r2 = _mm_sub_ps(one, _mm_mul_ps(ny, ny));
+    __m128 vertical = _mm_cmplt_ps(r2, _mm_set1_ps(1.0e-12f));
+    __m128 s = _mm_div_ps(one, _mm_sqrt_ps(_mm_max_ps(r2, _mm_set1_ps(1.0e-30f))));
+    __m128 mny = _mm_sub_ps(zero, ny);
+
+    __m128 ux = select(vertical, mny, _mm_mul_ps(_mm_mul_ps(mny, nx), s));
+    __m128 uy = select(vertical, zero, _mm_mul_ps(r2, s));
+    __m128 uz = select(vertical, zero, _mm_mul_ps(_mm_mul_ps(mny, nz), s));
+
+    __m128 vx = _mm_sub_ps(_mm_mul_ps(ny, uz), _mm_mul_ps(nz, uy));
+    __m128 vy = _mm_sub_ps(_mm_mul_ps(nz, ux), _mm_mul_ps(nx, uz));
+    __m128 vz = _mm_sub_ps(_mm_mul_ps(nx, uy), _mm_mul_ps(ny, ux));
+
+    _mm_storeu_ps(&f.ux[i], _mm_and_ps(keep, ux));
+    _mm_storeu_ps(&f.uy[i], _mm_and_ps(keep, uy));
+    _mm_storeu_ps(&f.uz[i], _mm_and_ps(keep, uz));
+    _mm_storeu_ps(&f.vx[i], _mm_and_ps(keep, vx));
+    _mm_storeu_ps(&f.vy[i], _mm_and_ps(keep, vy));
+    _mm_storeu_ps(&f.vz[i], _mm_and_ps(keep, vz));
+    _mm_storeu_ps(&f.dx[i], _mm_and_ps(keep, dx));
+    _mm_storeu_ps(&f.dy[i], _mm_and_ps(keep, dy));
+    _mm_storeu_ps(&f.dz[i], _mm_and_ps(keep, dz));
+}
+#endif
+
+struct FrameTask
+{
+    const QList<Bond> * bonds;
+    const int * which; // bonds to do, or 0 for all of them
+    const int * start;
+    float * matrices;
+    float doubleSpacing, tripleSpacing;
+
+    typedef void result_type;
+
+    int bondAt(int i) const
+    {
+        return which ? which[i] : i;
+    }
+
+    void operator()(const Range & range)
+    {
+        int n = range.last - range.first;
+        FrameBuffers f;
+        f.resize(n);
+
+        for (int i = 0; i < n; ++i)
+        {
+            const Bond & bond = bonds->at(bondAt(range.first + i));
+            f.ax[i] = bond.a->x;
+            f.ay[i] = bond.a->y;
+            f.az[i] = bond.a->z;
+            f.dx[i] = bond.b->x - bond.a->x;
+            f.dy[i] = bond.b->y - bond.a->y;
+            f.dz[i] = bond.b->z - bond.a->z;
+        }
+
+        int i = 0;
+#ifdef __SSE2__
+        for (; i + 4 <= n; i += 4)
+            frame4(f, i);
+#endif
+        for (; i < n; ++i)
+            frame(f, i);
+
+        for (i = 0; i < n; ++i)
+        {
+            int j = bondAt(range.first + i);
+            float offsets[3] = { 0, 0, 0 };
+            int count = start[j + 1] - start[j];
+            if (count == 2)
+            {
+                offsets[0] = -doubleSpacing;
+                offsets[1] = doubleSpacing;
+            }
+            else if (count == 3)
+            {
+                offsets[1] = -tripleSpacing;
+                offsets[2] = tripleSpacing;
+            }
+
+            for (int k = 0; k < count; ++k)
+            {
+                float * p = matrices + 16 * (start[j] + k);
+                p[0] = f.ux[i]; p[1] = f.uy[i]; p[2] = f.uz[i]; p[3] = 0;
+                p[4] = f.vx[i]; p[5] = f.vy[i]; p[6] = f.vz[i]; p[7] = 0;
+                p[8] = f.dx[i]; p[9] = f.dy[i]; p[10] = f.dz[i]; p[11] = 0;
+                p[12] = f.ax[i] + offsets[k] * f.ux[i];
+                p[13] = f.ay[i] + offsets[k] * f.uy[i];
+                p[14] = f.az[i] + offsets[k] * f.uz[i];
+                p[15] = 1;
+            }
+        }
+    }
+};
+
+static int instanceCount(BondType type)
+{
+    return type == btDouble ? 2 : type == btTriple ? 3 : 1;
+}
+
+static void run(FrameTask & task, int n)
+{
+    QVector<Range> ranges;
+    for (int first = 0; first < n; first += rangeSize)
+    {
+        Range range = { first, qMin(n, first + rangeSize) };
+        ranges.append(range);
+    }
+
+    if (ranges.count() > 1)
+        QtConcurrent::blockingMap(ranges, task);
+    else
+        foreach (const Range & range, ranges) task(range);
+}
+
+void bondInstances(const QList<Bond> & bonds, float doubleSpacing, float tripleSpacing, BondInstances & out)
+{
+    int n = bonds.count();
+    out.start.resize(n + 1);
+    out.start[0] = 0;
+    for (int i = 0; i < n; ++i)
+        out.start[i + 1] = out.start[i] + instanceCount(bonds.at(i).type);
+    out.matrices.resize(16 * out.start[n]);
+
+    FrameTask task;
+    task.bonds = &bonds;
+    task.which = 0;
+    task.start = out.start.constData();
+    task.matrices = out.matrices.data();
+    task.doubleSpacing = doubleSpacing;
+    task.tripleSpacing = tripleSpacing;
+    run(task, n);
+}
+
+void updateBondInstances(const QList<Bond> & bonds, const QVector<int> & which, float doubleSpacing, float tripleSpacing, BondInstances & out)
+{
+    // a bond that changed its order moves every instance after it
+    bool sameLayout = (out.start.count() == bonds.count() + 1);
+    for (int i = 0; sameLayout && i < which.count(); ++i)
+    {
+        int j = which.at(i);
+        sameLayout = (out.start[j + 1] - out.start[j] == instanceCount(bonds.at(j).type));
+    }
+    if (!sameLayout)
+    {
+        bondInstances(bonds, doubleSpacing, tripleSpacing, out);
+        return;
+    }
+
+    FrameTask task;
+    task.bonds = &bonds;
+    task.which = which.constData();
+    task.start = out.start.constData();
+    task.matrices = out.matrices.data();
+    task.doubleSpacing = doubleSpacing;
+    task.tripleSpacing = tripleSpacing;
+    run(task, which.count());
+}
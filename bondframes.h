@@ -0,0 +1,26 @@
+#ifndef BONDFRAMES_H
+#define BONDFRAMES_H
+
+#include <QVector>
+#include "molecule.h"
+
+// Transforms that map a unit cylinder along z (as drawn by gluCylinder)
+// onto bonds: one instance per single bond, two per double bond and three
+// per triple bond, side by side in the plane of the bond and the world
+// y axis. Zero-length bonds get a degenerate matrix.
+struct BondInstances
+{
+    QVector<float> matrices; // 16 per instance, column-major for glMultMatrixf
+    QVector<int> start;      // first instance of each bond; start[n] is the total
+};
+
+// Frames come from the normalized bond direction and the rejection of the
+// world y axis from it, with no trigonometry; coordinates are gathered into
+// contiguous arrays and processed four bonds at a time on all cores.
+void bondInstances(const QList<Bond> & bonds, float doubleSpacing, float tripleSpacing, BondInstances & out);
+
+// Recomputes only the listed bonds of out, which was made for the same bond
+// list; falls back to all bonds when their instance counts no longer match.
+void updateBondInstances(const QList<Bond> & bonds, const QVector<int> & which, float doubleSpacing, float tripleSpacing, BondInstances & out);
+
+#endif // BONDFRAMES_H
@@ -0,0 +1,515 @@
+#include "brickstore.h"
+#include "decompress.h"
+#include "pdb.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QScopedPointer>
+#include <QDataStream>
+#include <QtConcurrentRun>
+#include <QThread>
+#include <QtAlgorithms>
+#include <cmath>
+
+static const quint32 brickMagic = 0x51414232; // "QAB2"
+static const qint64 pageSize = 16384;
+static const qint64 dataOffset = 65536;
+static const int atomsPerBrick = 8192;
+
+// atoms are stored in native byte order
+struct BrickAtom
+{
+    float x, y, z;
+    quint16 element;
+    quint16 flags;
+};
+
+static const int atomsPerPage = pageSize / sizeof(BrickAtom);
+
+// first pass: bounds, center and the element table
+class BoundsSink : public AtomSink
+{
+public:
+    double lo[3], hi[3], sum[3];
+    qint64 count;
+    QHash<QString, int> elementIds;
+    QStringList elements;
+
+    BoundsSink()
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            lo[k] = 1e30; hi[k] = -1e30; sum[k] = 0;
+        }
+        count = 0;
+    }
+
+    virtual void atoms(const QVector<Atom> & atoms)
+    {
+        foreach (const Atom & atom, atoms)
+        {
+            double p[3] = { atom.x, atom.y, atom.z };
+            for (int k = 0; k < 3; ++k)
+            {
+                lo[k] = qMin(lo[k], p[k]);
+                hi[k] = qMax(hi[k], p[k]);
+                sum[k] += p[k];
+            }
+
+            if (!elementIds.contains(atom.element))
+            {
+                elementIds.insert(atom.element, elements.count());
+                elements.append(atom.element);
+            }
+        }
+        count += atoms.count();
+    }
+};
+
+// second pass: atoms go to their brick, full pages are written at once
+class BucketSink : public AtomSink
+{
+    QFile & out;
+    const BoundsSink & bounds;
+    double size[3];
+    int dims[3];
+    QVector<QVector<BrickAtom> > pending;
+
+public:
+    QVector<BrickInfo> bricks;
+    qint32 nextPage;
+    bool failed;
+
+    BucketSink(QFile & out, const BoundsSink & bounds)
+        : out(out), bounds(bounds)
+    {
+        nextPage = 0;
+        failed = false;
+
+        // cubic bricks of roughly atomsPerBrick atoms for uniform density
+        double volume = 1;
+        for (int k = 0; k < 3; ++k)
+            volume *= qMax(1.0, bounds.hi[k] - bounds.lo[k]);
+        double edge = pow(volume * atomsPerBrick / qMax<qint64>(1, bounds.count), 1.0 / 3);
+
+        int total = 1;
+        for (int k = 0; k < 3; ++k)
+        {
+            dims[k] = qBound(1, (int) ceil((bounds.hi[k] - bounds.lo[k]) / edge), 256);
+            size[k] = qMax(1e-3, (bounds.hi[k] - bounds.lo[k]) / dims[k]);
+            total *= dims[k];
+        }
+
+        pending.resize(total);
+        bricks.resize(total);
+        for (int i = 0; i < total; ++i)
+        {
+            bricks[i].atomCount = 0;
+            for (int k = 0; k < 3; ++k)
+            {
+                bricks[i].lo[k] = 1e30;
+                bricks[i].hi[k] = -1e30;
+            }
+        }
+    }
+
+    virtual void atoms(const QVector<Atom> & atoms)
+    {
+        foreach (const Atom & atom, atoms)
+        {
+            float p[3];
+            p[0] = atom.x; p[1] = atom.y; p[2] = atom.z;
+            int cell[3];
+            for (int k = 0; k < 3; ++k)
+                cell[k] = qBound(0, (int) ((p[k] - bounds.lo[k]) / size[k]), dims[k] - 1);
+            int b = (cell[2] * dims[1] + cell[1]) * dims[0] + cell[0];
+
+            BrickAtom brickAtom;
+            brickAtom.x = p[0]; brickAtom.y = p[1]; brickAtom.z = p[2];
+            brickAtom.element = bounds.elementIds.value(atom.element);
+            brickAtom.flags = 0;
+            pending[b].append(brickAtom);
+
+            BrickInfo & info = bricks[b];
+            for (int k = 0; k < 3; ++k)
+            {
+                info.lo[k] = qMin(info.lo[k], p[k]);
+                info.hi[k] = qMax(info.hi[k], p[k]);
+            }
+
+            if (pending[b].count() == atomsPerPage)
+                flush(b);
+        }
+    }
+
+    void flush(int b)
+    {
+        QVector<BrickAtom> & page = pending[b];
+        if (page.isEmpty()) return;
+
+        qint64 bytes = page.count() * sizeof(BrickAtom);
+        if (!out.seek(dataOffset + nextPage * pageSize)
+            || out.write((const char *) page.constData(), bytes) != bytes)
+            failed = true;
+
+        bricks[b].pages.append(nextPage++);
+        bricks[b].atomCount += page.count();
+        page.clear();
+    }
+
+    void finish()
+    {
+        for (int b = 0; b < pending.count(); ++b)
+            flush(b);
+    }
+};
+
+bool BrickStore::build(const QString & source, const QString & target)
+{
+    QString suffix = QFileInfo(uncompressedName(source)).suffix().toLower();
+    bool cif = (suffix == "cif" || suffix == "mmcif");
+
+    // taken first, so that a change during the build makes the bricks stale
+    QString stamp = fileStamp(source);
+
+    BoundsSink bounds;
+    {
+        QScopedPointer<QIODevice> dev(openMoleculeFile(source));
+        if (!dev) return false;
+        if (!streamAtoms(*dev, cif, bounds)) return false;
+        if (!decompressError(*dev).isEmpty()) return false;
+    }
+    if (!bounds.count) return false;
+
+    QFile out(target);
+    if (!out.open(QIODevice::ReadWrite | QIODevice::Truncate)) return false;
+
+    BucketSink buckets(out, bounds);
+    {
+        QScopedPointer<QIODevice> dev(openMoleculeFile(source));
+        if (!dev) return false;
+        if (!streamAtoms(*dev, cif, buckets)) return false;
+        if (!decompressError(*dev).isEmpty()) return false;
+    }
+    buckets.finish();
+
+    // empty bricks are dropped; the table follows the last page
+    QVector<BrickInfo> bricks;
+    foreach (const BrickInfo & info, buckets.bricks)
+    {
+        if (info.atomCount)
+            bricks.append(info);
+    }
+
+    qint64 tableOffset = dataOffset + buckets.nextPage * pageSize;
+    out.seek(tableOffset);
+    {
+        QDataStream table(&out);
+        table << (qint32) bricks.count();
+        foreach (const BrickInfo & info, bricks)
+        {
+            table << (qint32) info.atomCount;
+            for (int k = 0; k < 3; ++k)
+                table << info.lo[k] << info.hi[k];
+            table << info.pages;
+        }
+    }
+
+    QByteArray header;
+    {
+        QDataStream stream(&header, QIODevice::WriteOnly);
+        stream << brickMagic << stamp << (qint64) bounds.count << tableOffset << bounds.elements;
+        for (int k = 0; k < 3; ++k)
+            stream << bounds.sum[k] / bounds.count;
+    }
+    if (header.size() > dataOffset) return false;
+
+    out.seek(0);
+    out.write(header);
+    return !buckets.failed && out.error() == QFile::NoError;
+}
+
+BrickStore::BrickStore()
+{
+    atomCount = 0;
+    center[0] = center[1] = center[2] = 0;
+}
+
+bool BrickStore::isCurrent(const QString & source, const QString & target)
+{
+    QFile f(target);
+    if (!f.open(QIODevice::ReadOnly)) return false;
+
+    QDataStream stream(&f);
+    quint32 magic;
+    QString stamp;
+    stream >> magic;
+    if (magic != brickMagic) return false;
+
+    stream >> stamp;
+    return stream.status() == QDataStream::Ok && !stamp.isEmpty() && stamp == fileStamp(source);
+}
+
+bool BrickStore::open(const QString & fname)
+{
+    QFile f(fname);
+    if (!f.open(QIODevice::ReadOnly)) return false;
+
+    QDataStream stream(&f);
+    quint32 magic;
+    QString stamp;
+    qint64 tableOffset;
+    stream >> magic;
+    if (magic != brickMagic) return false;
+
+    stream >> stamp >> atomCount >> tableOffset >> elements;
+    for (int k = 0; k < 3; ++k)
+        stream >> center[k];
+
+    f.seek(tableOffset);
+    qint32 count;
+    stream >> count;
+    bricks.resize(count);
+    for (int i = 0; i < count; ++i)
+    {
+        BrickInfo & info = bricks[i];
+        qint32 atoms;
+        stream >> atoms;
+        info.atomCount = atoms;
+        for (int k = 0; k < 3; ++k)
+            stream >> info.lo[k] >> info.hi[k];
+        stream >> info.pages;
+    }
+
+    this->fname = fname;
+    return stream.status() == QDataStream::Ok;
+}
+
+static double bondCutoff(const QString & a, const QString & b)
+{
+    bool hydrogen = (a == "H" || b == "H");
+    bool heavy = (a == "S" || b == "S" || a == "P" || b == "P");
+    return hydrogen ? 1.2 : heavy ? 2.1 : 1.75;
+}
+
+// bonds by distance on a grid of cells as wide as the longest bond
+static void bondByDistance(Molecule & molecule)
+{
+    const double cell = 2.1;
+    QList<Atom> & atoms = molecule.atoms;
+    if (atoms.isEmpty()) return;
+
+    double lo[3] = { atoms[0].x, atoms[0].y, atoms[0].z };
+    foreach (const Atom & atom, atoms)
+    {
+        lo[0] = qMin(lo[0], atom.x);
+        lo[1] = qMin(lo[1], atom.y);
+        lo[2] = qMin(lo[2], atom.z);
+    }
+
+    QHash<qint64, int> head;
+    QVector<int> next(atoms.count(), -1);
+    QVector<qint64> keys(atoms.count());
+    for (int i = 0; i < atoms.count(); ++i)
+    {
+        const Atom & atom = atoms.at(i);
+        qint64 cx = (atom.x - lo[0]) / cell, cy = (atom.y - lo[1]) / cell, cz = (atom.z - lo[2]) / cell;
+        keys[i] = (cz << 40) | (cy << 20) | cx;
+        next[i] = head.value(keys[i], -1);
+        head.insert(keys[i], i);
+    }
+
+    for (int i = 0; i < atoms.count(); ++i)
+    {
+        const Atom & a = atoms.at(i);
+        qint64 cx = keys[i] & 0xFFFFF, cy = (keys[i] >> 20) & 0xFFFFF, cz = keys[i] >> 40;
+        for (qint64 dz = -1; dz <= 1; ++dz)
+        for (qint64 dy = -1; dy <= 1; ++dy)
+        for (qint64 dx = -1; dx <= 1; ++dx)
+        {
+            if (cx + dx < 0 || cy + dy < 0 || cz + dz < 0) continue;
+            qint64 key = ((cz + dz) << 40) | ((cy + dy) << 20) | (cx + dx);
+            for (int j = head.value(key, -1); j >= 0; j = next[j])
+            {
+                if (j <= i) continue;
+                const Atom & b = atoms.at(j);
+                double d2 = (a.x-b.x)*(a.x-b.x) + (a.y-b.y)*(a.y-b.y) + (a.z-b.z)*(a.z-b.z);
+                double cutoff = bondCutoff(a.element, b.element);
+                if (d2 > 0.16 && d2 < cutoff * cutoff)
+                {
+                    Bond bond;
+                    bond.indexA = i;
+                    bond.indexB = j;
+                    bond.type = btSingle;
+                    molecule.bonds.append(bond);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < molecule.bonds.count(); ++i)
+    {
+        Bond & bond = molecule.bonds[i];
+        bond.a = &atoms[bond.indexA];
+        bond.b = &atoms[bond.indexB];
+    }
+}
+
+Molecule BrickStore::loadBrick(int i) const
+{
+    Molecule molecule;
+    molecule.massCenterX = center[0];
+    molecule.massCenterY = center[1];
+    molecule.massCenterZ = center[2];
+
+    QFile f(fname);
+    if (i < 0 || i >= bricks.count() || !f.open(QIODevice::ReadOnly))
+        return molecule;
+
+    const BrickInfo & info = bricks[i];
+    QVector<BrickAtom> page(atomsPerPage);
+    int remaining = info.atomCount;
+    foreach (qint32 p, info.pages)
+    {
+        int count = qMin(remaining, atomsPerPage);
+        f.seek(dataOffset + p * pageSize);
+        if (f.read((char *) page.data(), count * sizeof(BrickAtom)) != qint64(count * sizeof(BrickAtom)))
+            break;
+
+        for (int k = 0; k < count; ++k)
+        {
+            Atom atom;
+            atom.x = page[k].x;
+            atom.y = page[k].y;
+            atom.z = page[k].z;
+            atom.element = elements.value(page[k].element);
+            molecule.atoms.append(atom);
+        }
+        remaining -= count;
+    }
+
+    bondByDistance(molecule);
+    return molecule;
+}
+
+BrickCache::BrickCache(const BrickStore * store, qint64 budget, QObject * parent)
+    : QObject(parent)
+{
+    this->store = store;
+    this->budget = budget;
+    used = 0;
+    frame = 0;
+}
+
+BrickCache::~BrickCache()
+{
+    foreach (QFutureWatcher<Molecule> * watcher, loading)
+    {
+        watcher->disconnect(this);
+        watcher->waitForFinished();
+        delete watcher;
+    }
+}
+
+void BrickCache::setBudget(qint64 bytes)
+{
+    budget = bytes;
+}
+
+void BrickCache::beginFrame()
+{
+    ++frame;
+}
+
+const Molecule * BrickCache::request(int brick)
+{
+    QHash<int, Entry>::iterator it = resident.find(brick);
+    if (it != resident.end())
+    {
+        it->lastUse = frame;
+        return &it->molecule;
+    }
+
+    // nearer bricks are requested first, so they get the free threads
+    if (!loading.contains(brick) && loading.count() < QThread::idealThreadCount())
+    {
+        QFutureWatcher<Molecule> * watcher = new QFutureWatcher<Molecule>(this);
+        connect(watcher, SIGNAL(finished()), this, SLOT(loadFinished()));
+        watcher->setFuture(QtConcurrent::run(store, &BrickStore::loadBrick, brick));
+        loading.insert(brick, watcher);
+    }
+    return 0;
+}
+
+void BrickCache::loadFinished()
+{
+    QFutureWatcher<Molecule> * watcher = static_cast<QFutureWatcher<Molecule> *>(sender());
+    int brick = loading.key(watcher);
+    loading.remove(brick);
+
+    Entry entry;
+    entry.molecule = watcher->result();
+    entry.lists[0] = entry.lists[1] = entry.lists[2] = 0;
+    entry.bytes = entry.molecule.atoms.count() * (sizeof(Atom) + 32)
+        + entry.molecule.bonds.count() * (sizeof(Bond) + 32);
+    entry.lastUse = frame;
+
+    resident.insert(brick, entry);
+    used += entry.bytes;
+    watcher->deleteLater();
+
+    emit loaded();
+}
+
+GLuint & BrickCache::list(int brick, int lod)
+{
+    return resident[brick].lists[lod];
+}
+
+void BrickCache::addBytes(int brick, qint64 bytes)
+{
+    resident[brick].bytes += bytes;
+    used += bytes;
+}
+
+static bool byLastUse(const QPair<int, int> & a, const QPair<int, int> & b)
+{
+    return a.first < b.first;
+}
+
+void BrickCache::trim()
+{
+    if (used <= budget) return;
+
+    QList<QPair<int, int> > order;
+    for (QHash<int, Entry>::const_iterator it = resident.constBegin(); it != resident.constEnd(); ++it)
+        order.append(qMakePair(it->lastUse, it.key()));
+    qSort(order.begin(), order.end(), byLastUse);
+
+    for (int i = 0; i < order.count() && used > budget; ++i)
+    {
+        if (order[i].first >= frame) break;
+
+        Entry & entry = resident[order[i].second];
+        for (int k = 0; k < 3; ++k)
+        {
+            if (entry.lists[k])
+                glDeleteLists(entry.lists[k], 1);
+        }
+        used -= entry.bytes;
+        resident.remove(order[i].second);
+    }
+}
+
+void BrickCache::clear()
+{
+    foreach (const Entry & entry, resident)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            if (entry.lists[k])
+                glDeleteLists(entry.lists[k], 1);
+        }
+    }
+    resident.clear();
+    used = 0;
+}
@@ -0,0 +1,104 @@
+#ifndef BRICKSTORE_H
+#define BRICKSTORE_H
+
+#include <QObject>
+#include <QStringList>
+#include <QVector>
+#include <QHash>
+#include <QFutureWatcher>
+#include <QtOpenGL>
+
+#include "molecule.h"
+
+struct BrickInfo
+{
+    int atomCount;
+    float lo[3], hi[3];
+    QVector<qint32> pages;
+};
+
+// Atoms of a structure too large to hold in memory, sorted into spatial
+// bricks and stored in fixed-size pages of a file. Bricks are read back
+// one at a time and bonded by distance; bonds that cross a brick boundary
+// are not drawn.
+class BrickStore
+{
+    QString fname;
+    QStringList elements;
+    QVector<BrickInfo> bricks;
+    qint64 atomCount;
+    double center[3];
+
+public:
+    BrickStore();
+
+    // converts a PDB or mmCIF file (possibly compressed), streaming it twice
+    static bool build(const QString & source, const QString & target);
+
+    // true if the bricks were built from the source as it is now
+    static bool isCurrent(const QString & source, const QString & target);
+
+    bool open(const QString & fname);
+
+    int brickCount() const { return bricks.count(); }
+    const BrickInfo & brick(int i) const { return bricks[i]; }
+    qint64 atoms() const { return atomCount; }
+    double centerX() const { return center[0]; }
+    double centerY() const { return center[1]; }
+    double centerZ() const { return center[2]; }
+
+    // safe to call from any thread
+    Molecule loadBrick(int i) const;
+};
+
+// Least recently used set of resident bricks and their display lists,
+// kept within a memory budget. Missing bricks are loaded on the thread pool.
+class BrickCache : public QObject
+{
+Q_OBJECT
+
+    struct Entry
+    {
+        Molecule molecule;
+        GLuint lists[3]; // per level of detail
+        qint64 bytes;
+        int lastUse;
+    };
+
+    const BrickStore * store;
+    QHash<int, Entry> resident;
+    QHash<int, QFutureWatcher<Molecule> *> loading;
+    qint64 budget, used;
+    int frame;
+
+public:
+    BrickCache(const BrickStore * store, qint64 budget, QObject * parent = 0);
+    virtual ~BrickCache();
+
+    void setBudget(qint64 bytes);
+    qint64 usedBytes() const { return used; }
+    int residentCount() const { return resident.count(); }
+    int loadingCount() const { return loading.count(); }
+
+    void beginFrame();
+
+    // the brick if it is resident, otherwise 0 and the brick is queued
+    const Molecule * request(int brick);
+
+    // display list of a resident brick; 0 until compiled
+    GLuint & list(int brick, int lod);
+    void addBytes(int brick, qint64 bytes);
+
+    // drops least recently used bricks not drawn in this frame until the
+    // budget is met; needs the GL context current
+    void trim();
+    void clear();
+
+signals:
+    void loaded();
+
+private slots:
+    void loadFinished();
+};
+
+#endif // BRICKSTORE_H
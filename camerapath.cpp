@@ -0,0 +1,186 @@
+#include "camerapath.h"
+#include <QStringList>
+#include <QElapsedTimer>
+#include <QtAlgorithms>
+#include <cmath>
+
+bool readCameraPath(const QString & fname, QVector<CameraFrame> & path)
+{
+    QFile file(fname);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+
+    path.clear();
+    QTextStream in(&file);
+    while (!in.atEnd())
+    {
+        QString line = in.readLine().trimmed();
+        if (line.isEmpty() || line.startsWith('#')) continue;
+
+        QStringList f = line.split(' ', QString::SkipEmptyParts);
+        if (f.count() < 11) return false;
+
+        CameraFrame frame;
+        frame.time = f[0].toInt();
+        frame.state.xRot = f[1].toDouble();
+        frame.state.yRot = f[2].toDouble();
+        frame.state.zRot = f[3].toDouble();
+        frame.state.scale = f[4].toDouble();
+        frame.state.panX = f[5].toDouble();
+        frame.state.panY = f[6].toDouble();
+        frame.state.panZ = f[7].toDouble();
+        frame.state.eyeDistance = f[8].toInt();
+        frame.state.moleculeSize = f[9].toInt();
+        frame.state.anaglyph = f[10].toInt();
+        path.append(frame);
+    }
+    return true;
+}
+
+QVector<CameraFrame> spinPath(const CameraState & from)
+{
+    QVector<CameraFrame> path;
+    for (int i = 0; i <= 360; ++i)
+    {
+        CameraFrame frame;
+        frame.time = i * 20;
+        frame.state = from;
+        frame.state.yRot = fmod(from.yRot + i, 360);
+        path.append(frame);
+    }
+    return path;
+}
+
+CameraRecorder::CameraRecorder(GLWidget * display, QObject * parent)
+    : QObject(parent)
+{
+    this->display = display;
+    started = false;
+}
+
+bool CameraRecorder::start(const QString & fname)
+{
+    stop();
+
+    file.setFileName(fname);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+        return false;
+
+    out.setDevice(&file);
+    out.setRealNumberPrecision(10);
+    out << "# time_ms xrot yrot zrot scale pan_x pan_y pan_z eye size anaglyph\n";
+
+    started = false;
+    clock.start();
+    connect(display, SIGNAL(frameDrawn()), this, SLOT(frameDrawn()));
+
+    // the path starts where the view is now
+    frameDrawn();
+    return true;
+}
+
+void CameraRecorder::stop()
+{
+    if (!file.isOpen()) return;
+
+    disconnect(display, SIGNAL(frameDrawn()), this, SLOT(frameDrawn()));
+    out.flush();
+    out.setDevice(0);
+    file.close();
+}
+
+void CameraRecorder::frameDrawn()
+{
+    CameraState state = display->cameraState();
+    if (started && state == last) return;
+
+    out << clock.elapsed()
+        << ' ' << state.xRot << ' ' << state.yRot << ' ' << state.zRot
+        << ' ' << state.scale
+        << ' ' << state.panX << ' ' << state.panY << ' ' << state.panZ
+        << ' ' << state.eyeDistance << ' ' << state.moleculeSize
+        << ' ' << (state.anaglyph ? 1 : 0) << '\n';
+
+    last = state;
+    started = true;
+}
+
+// nearest rank
+static double percentile(const QVector<double> & sorted, double p)
+{
+    if (sorted.isEmpty()) return 0;
+    int rank = (int) ceil(p / 100 * sorted.count());
+    return sorted[qBound(0, rank - 1, sorted.count() - 1)];
+}
+
+static QString statLine(const char * name, QVector<double> values)
+{
+    qSort(values);
+
+    double sum = 0;
+    foreach (double v, values)
+        sum += v;
+
+    return QString("%1 mean %2 p50 %3 p95 %4 p99 %5 max %6\n")
+        .arg(QString(name), -5)
+        .arg(values.isEmpty() ? 0 : sum / values.count(), 0, 'f', 3)
+        .arg(percentile(values, 50), 0, 'f', 3)
+        .arg(percentile(values, 95), 0, 'f', 3)
+        .arg(percentile(values, 99), 0, 'f', 3)
+        .arg(values.isEmpty() ? 0 : values.last(), 0, 'f', 3);
+}
+
+QString ReplayReport::summary() const
+{
+    QVector<double> cpu, gpu, total;
+    foreach (const FrameTiming & frame, frames)
+    {
+        cpu.append(frame.cpuMs);
+        total.append(frame.totalMs);
+        if (frame.gpuMs >= 0)
+            gpu.append(frame.gpuMs);
+    }
+
+    QString text = QString("frames %1 (ms)\n").arg(frames.count());
+    text += statLine("cpu", cpu);
+    text += gpu.isEmpty() ? QString("gpu   n/a (no timer queries)\n") : statLine("gpu", gpu);
+    text += statLine("total", total);
+    return text;
+}
+
+bool ReplayReport::writeLog(const QString & fname) const
+{
+    QFile file(fname);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+        return false;
+
+    QTextStream out(&file);
+    out << "frame,time_ms,cpu_ms,gpu_ms,total_ms\n";
+    for (int i = 0; i < frames.count(); ++i)
+    {
+        out << i << ',' << times[i] << ',' << frames[i].cpuMs << ','
+            << frames[i].gpuMs << ',' << frames[i].totalMs << '\n';
+    }
+    return true;
+}
+
+ReplayReport replayCameraPath(GLWidget * display, const QVector<CameraFrame> & path)
+{
+    ReplayReport report;
+    QElapsedTimer timer;
+
+    foreach (const CameraFrame & frame, path)
+    {
+        timer.start();
+        display->setCameraState(frame.state);
+        double applyMs = timer.nsecsElapsed() / 1.0e6;
+
+        FrameTiming timing = display->profileFrame();
+        timing.cpuMs += applyMs;
+        timing.totalMs += applyMs;
+
+        report.times.append(frame.time);
+        report.frames.append(timing);
+    }
+    return report;
+}
@@ -0,0 +1,63 @@
+#ifndef CAMERAPATH_H
+#define CAMERAPATH_H
+
+#include <QObject>
+#include <QFile>
+#include <QTextStream>
+#include <QTime>
+#include <QVector>
+
+#include "glwidget.h"
+
+struct CameraFrame
+{
+    int time; // ms from the start of the recording
+    CameraState state;
+};
+
+// One frame per line: time_ms xrot yrot zrot scale pan_x pan_y pan_z
+// eye size anaglyph; lines starting with # are comments.
+bool readCameraPath(const QString & fname, QVector<CameraFrame> & path);
+
+// a full turn about the y axis from the given state, one degree per frame
+QVector<CameraFrame> spinPath(const CameraState & from);
+
+// Writes the view after every frame the display draws in which it changed.
+class CameraRecorder : public QObject
+{
+Q_OBJECT
+
+    GLWidget * display;
+    QFile file;
+    QTextStream out;
+    QTime clock;
+    CameraState last;
+    bool started;
+
+public:
+    CameraRecorder(GLWidget * display, QObject * parent = 0);
+
+    bool start(const QString & fname);
+    void stop();
+
+private slots:
+    void frameDrawn();
+};
+
+struct ReplayReport
+{
+    QVector<int> times;
+    QVector<FrameTiming> frames;
+
+    // frame count with mean, p50, p95, p99 and max of each time
+    QString summary() const;
+
+    // one line per frame, comma separated
+    bool writeLog(const QString & fname) const;
+};
+
+// Applies the frames to the display one by one, as fast as it renders
+// them, and times each; changes of render mode count towards the frame.
+ReplayReport replayCameraPath(GLWidget * display, const QVector<CameraFrame> & path);
+
+#endif // CAMERAPATH_H
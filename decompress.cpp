@@ -0,0 +1,477 @@
+#include "decompress.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QVector>
+#include <QMutexLocker>
+#include <string.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#ifdef Q_OS_LINUX
+#include <sys/stat.h>
+#endif
+
+static const int blockSize = 1 << 20;
+static const qint64 maxQueued = 16 * blockSize;
+
+Compression detectCompression(QIODevice & dev)
+{
+    QByteArray magic = dev.peek(4);
+
+    if (magic.size() >= 2 && (uchar) magic[0] == 0x1f && (uchar) magic[1] == 0x8b)
+        return cmGzip;
+
+    if (magic.size() == 4 && (uchar) magic[0] == 0x28 && (uchar) magic[1] == 0xb5
+            && (uchar) magic[2] == 0x2f && (uchar) magic[3] == 0xfd)
+        return cmZstd;
+
+    return cmNone;
+}
+
+QString uncompressedName(const QString & fname)
+{
+    if (fname.endsWith(".gz", Qt::CaseInsensitive))
+        return fname.left(fname.length() - 3);
+    if (fname.endsWith(".zst", Qt::CaseInsensitive))
+        return fname.left(fname.length() - 4);
+
+    return fname;
+}
+
+// QFileInfo only has whole seconds, which misses quick rewrites
+QString fileStamp(const QString & fname)
+{
+#ifdef Q_OS_LINUX
+    struct stat st;
+    if (stat(QFile::encodeName(fname).constData(), &st) != 0)
+        return QString();
+    return QString("%1:%2.%3").arg((qint64) st.st_size).arg((qint64) st.st_mtim.tv_sec)
+        .arg((qint64) st.st_mtim.tv_nsec, 9, 10, QChar('0'));
+#else
+    QFileInfo info(fname);
+    if (!info.exists())
+        return QString();
+    return QString("%1:%2").arg(info.size()).arg(info.lastModified().toMSecsSinceEpoch());
+#endif
+}
+
+DecompressStream::DecompressStream(const QString & fname, Compression compression)
+    : worker(this)
+{
+    this->fname = fname;
+    this->compression = compression;
+    blockOffset = 0;
+    queued = 0;
+    finished = aborted = false;
+}
+
+DecompressStream::~DecompressStream()
+{
+    close();
+}
+
+bool DecompressStream::open(OpenMode mode)
+{
+    if (mode & WriteOnly) return false;
+    if (!QIODevice::open(mode)) return false;
+
+    finished = aborted = false;
+    error.clear();
+    worker.start();
+    return true;
+}
+
+void DecompressStream::close()
+{
+    {
+        QMutexLocker lock(&mutex);
+        aborted = true;
+        writable.wakeAll();
+    }
+    worker.wait();
+
+    blocks.clear();
+    blockOffset = 0;
+    queued = 0;
+
+    if (isOpen())
+        QIODevice::close();
+}
+
+bool DecompressStream::isSequential() const
+{
+    return true;
+}
+
+bool DecompressStream::atEnd() const
+{
+    QMutexLocker lock(&mutex);
+    return finished && blocks.isEmpty() && QIODevice::bytesAvailable() == 0;
+}
+
+qint64 DecompressStream::bytesAvailable() const
+{
+    QMutexLocker lock(&mutex);
+    return queued + QIODevice::bytesAvailable();
+}
+
+qint64 DecompressStream::readData(char * data, qint64 maxSize)
+{
+    QMutexLocker lock(&mutex);
+    while (blocks.isEmpty() && !finished)
+        readable.wait(&mutex);
+
+    if (blocks.isEmpty() && !error.isEmpty())
+    {
+        setErrorString(error);
+        return -1;
+    }
+
+    qint64 done = 0;
+    while (done < maxSize && !blocks.isEmpty())
+    {
+        const QByteArray & block = blocks.head();
+        qint64 n = qMin(maxSize - done, (qint64) (block.size() - blockOffset));
+        memcpy(data + done, block.constData() + blockOffset, n);
+        done += n;
+        blockOffset += n;
+
+        if (blockOffset == block.size())
+        {
+            blocks.dequeue();
+            blockOffset = 0;
+        }
+    }
+
+    queued -= done;
+    writable.wakeAll();
+    return done;
+}
+
+qint64 DecompressStream::writeData(const char *, qint64)
+{
+    return -1;
+}
+
+// called by the worker; blocks while the reader is too far behind
+bool DecompressStream::push(const char * data, qint64 size)
+{
+    QMutexLocker lock(&mutex);
+    while (queued >= maxQueued && !aborted)
+        writable.wait(&mutex);
+
+    if (aborted) return false;
+    if (size == 0) return true;
+
+    blocks.enqueue(QByteArray(data, size));
+    queued += size;
+    readable.wakeAll();
+    return true;
+}
+
+void DecompressStream::finish()
+{
+    QMutexLocker lock(&mutex);
+    finished = true;
+    readable.wakeAll();
+}
+
+void DecompressStream::fail(const QString & message)
+{
+    QMutexLocker lock(&mutex);
+    error = message + " in " + fname;
+}
+
+QString DecompressStream::failure() const
+{
+    QMutexLocker lock(&mutex);
+    return error;
+}
+
+// Input is only read once a call leaves room in the output buffer, since
+// until then the decompressor may still hold output of the last input.
+void DecompressStream::inflateGzip()
+{
+    QFile f(fname);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        fail("Unable to open file");
+        return;
+    }
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, 15 + 32) != Z_OK) // +32: accept gzip and zlib headers
+    {
+        fail("Unable to start gzip decompression");
+        return;
+    }
+
+    QByteArray in;
+    QByteArray out(blockSize, 0);
+    bool full = false, eof = false;
+    while (true)
+    {
+        if (z.avail_in == 0 && !full && !eof)
+        {
+            in = f.read(blockSize);
+            if (f.error() != QFile::NoError)
+            {
+                fail("Read error");
+                break;
+            }
+            eof = in.isEmpty();
+
+            z.next_in = (Bytef *) in.data();
+            z.avail_in = in.size();
+        }
+
+        z.next_out = (Bytef *) out.data();
+        z.avail_out = out.size();
+
+        int ret = inflate(&z, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+        {
+            fail(QString("Corrupt gzip data (%1)").arg(z.msg ? z.msg : "unknown error"));
+            break;
+        }
+        if (!push(out.constData(), out.size() - z.avail_out)) break;
+        full = (z.avail_out == 0);
+
+        if (ret == Z_STREAM_END)
+        {
+            // another gzip member may follow; anything else, such as the
+            // zero padding that tar and tape tools add, ends the stream
+            while (z.avail_in < 2 && !f.atEnd())
+            {
+                in = QByteArray((const char *) z.next_in, z.avail_in) + f.read(blockSize);
+                z.next_in = (Bytef *) in.data();
+                z.avail_in = in.size();
+            }
+            if (z.avail_in < 2 || z.next_in[0] != 0x1f || z.next_in[1] != 0x8b) break;
+
+            inflateReset(&z);
+            continue;
+        }
+
+        if (eof && !full)
+        {
+            fail("Truncated gzip data");
+            break;
+        }
+    }
+
+    inflateEnd(&z);
+}
+
+void DecompressStream::inflateZstd()
+{
+    QFile f(fname);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        fail("Unable to open file");
+        return;
+    }
+
+    ZSTD_DStream * ds = ZSTD_createDStream();
+    ZSTD_initDStream(ds);
+
+    QByteArray in;
+    QByteArray out(ZSTD_DStreamOutSize(), 0);
+    ZSTD_inBuffer input = { 0, 0, 0 };
+    size_t ret = 0; // 0 between frames, else more input is expected
+    bool full = false;
+    while (true)
+    {
+        if (input.pos == input.size && !full)
+        {
+            in = f.read(qMax((int) ZSTD_DStreamInSize(), blockSize));
+            if (f.error() != QFile::NoError)
+            {
+                fail("Read error");
+                break;
+            }
+            if (in.isEmpty())
+            {
+                if (ret != 0)
+                    fail("Truncated zstd data");
+                break;
+            }
+
+            input.src = in.constData();
+            input.size = in.size();
+            input.pos = 0;
+        }
+
+        // skippable frames, such as a seek table, produce no output
+        ZSTD_outBuffer output = { out.data(), (size_t) out.size(), 0 };
+        ret = ZSTD_decompressStream(ds, &output, &input);
+        if (ZSTD_isError(ret))
+        {
+            fail(QString("Corrupt zstd data (%1)").arg(ZSTD_getErrorName(ret)));
+            break;
+        }
+        if (!push(out.constData(), output.pos)) break;
+        full = (output.pos == output.size);
+    }
+
+    ZSTD_freeDStream(ds);
+}
+
+void DecompressStream::Worker::run()
+{
+    switch (stream->compression)
+    {
+    case cmGzip:
+        stream->inflateGzip();
+        break;
+    case cmZstd:
+        stream->inflateZstd();
+        break;
+    default:
+        break;
+    }
+
+    stream->finish();
+}
+
+QIODevice * openMoleculeFile(const QString & fname)
+{
+    QFile * f = new QFile(fname);
+    if (!f->open(QIODevice::ReadOnly))
+    {
+        delete f;
+        return 0;
+    }
+
+    Compression compression = detectCompression(*f);
+    if (compression == cmNone)
+        return f;
+
+    delete f;
+    DecompressStream * stream = new DecompressStream(fname, compression);
+    stream->open(QIODevice::ReadOnly);
+    return stream;
+}
+
+// Only errors that cut short the data already read count; the rest of
+// the file is not inflated just to look for one.
+QString decompressError(QIODevice & dev)
+{
+    DecompressStream * stream = dynamic_cast<DecompressStream *>(&dev);
+    if (!stream || !stream->atEnd()) return QString();
+
+    return stream->failure();
+}
+
+struct SeekEntry
+{
+    qint64 compressedOffset, compressedSize;
+    qint64 offset, size;
+};
+
+static inline quint32 readLE32(const char * p)
+{
+    const uchar * u = (const uchar *) p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((quint32) u[3] << 24);
+}
+
+// larger frames are not expected from seekable writers
+static const qint64 maxFrameSize = 256 << 20;
+
+// Seek table of the zstd seekable format: a skippable frame at the end of
+// the file, listing the compressed and decompressed size of every frame.
+// Tables whose frames do not fill the file exactly are rejected.
+static bool readSeekTable(QFile & f, QVector<SeekEntry> & table)
+{
+    const int footerSize = 9;
+    if (f.size() < footerSize + 8) return false;
+
+    f.seek(f.size() - footerSize);
+    QByteArray footer = f.read(footerSize);
+    if (footer.size() != footerSize || readLE32(footer.constData() + 5) != 0x8F92EAB1u)
+        return false;
+
+    qint64 frames = readLE32(footer.constData());
+    int entrySize = (footer[4] & 0x80) ? 12 : 8;
+    qint64 tableSize = frames * entrySize;
+    if (f.size() < tableSize + footerSize + 8) return false;
+
+    f.seek(f.size() - footerSize - tableSize);
+    QByteArray entries = f.read(tableSize);
+    if (entries.size() != tableSize) return false;
+
+    qint64 compressedOffset = 0, offset = 0;
+    table.resize(frames);
+    for (int i = 0; i < frames; ++i)
+    {
+        const char * p = entries.constData() + i * entrySize;
+        table[i].compressedOffset = compressedOffset;
+        table[i].compressedSize = readLE32(p);
+        table[i].offset = offset;
+        table[i].size = readLE32(p + 4);
+        if (table[i].size > maxFrameSize) return false;
+
+        compressedOffset += table[i].compressedSize;
+        offset += table[i].size;
+    }
+
+    // the frames, then the table's skippable frame header, entries and footer
+    return compressedOffset == f.size() - tableSize - footerSize - 8;
+}
+
+QByteArray readDecompressedRange(const QString & fname, qint64 offset, qint64 length)
+{
+    QFile f(fname);
+    if (!f.open(QIODevice::ReadOnly)) return QByteArray();
+
+    Compression compression = detectCompression(f);
+    if (compression == cmNone)
+    {
+        f.seek(offset);
+        return f.read(length);
+    }
+
+    QVector<SeekEntry> table;
+    if (compression == cmZstd && readSeekTable(f, table))
+    {
+        QByteArray result;
+        foreach (const SeekEntry & frame, table)
+        {
+            if (frame.offset + frame.size <= offset) continue;
+            if (frame.offset >= offset + length) break;
+
+            f.seek(frame.compressedOffset);
+            QByteArray in = f.read(frame.compressedSize);
+            unsigned long long content = ZSTD_getFrameContentSize(in.constData(), in.size());
+            if (content != ZSTD_CONTENTSIZE_UNKNOWN && content != (unsigned long long) frame.size)
+                return QByteArray();
+
+            QByteArray out(frame.size, 0);
+            size_t ret = ZSTD_decompress(out.data(), out.size(), in.constData(), in.size());
+            if (ZSTD_isError(ret)) return QByteArray();
+
+            qint64 from = qMax(offset - frame.offset, (qint64) 0);
+            qint64 to = qMin(offset + length - frame.offset, frame.size);
+            result.append(out.constData() + from, to - from);
+        }
+        return result;
+    }
+
+    // no index; decompress from the start and throw away the prefix
+    f.close();
+    DecompressStream stream(fname, compression);
+    stream.open(QIODevice::ReadOnly);
+
+    QByteArray result;
+    while (offset > 0 && !stream.atEnd())
+        offset -= stream.read(qMin(offset, (qint64) blockSize)).size();
+    while (result.size() < length && !stream.atEnd())
+        result.append(stream.read(length - result.size()));
+
+    // an error past the range does not matter
+    if (result.size() < length && !stream.failure().isEmpty())
+        return QByteArray();
+    return result;
+}
@@ -0,0 +1,89 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <QIODevice>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QByteArray>
+#include <QString>
+
+enum Compression
+{
+    cmNone,
+    cmGzip,
+    cmZstd
+};
+
+Compression detectCompression(QIODevice & dev);
+
+// Sequential device that inflates a gzip or zstd file on its own thread
+// while the reader consumes the output. Reads block until data arrives.
+class DecompressStream : public QIODevice
+{
+    class Worker : public QThread
+    {
+        DecompressStream * stream;
+    public:
+        Worker(DecompressStream * stream) : stream(stream) {}
+    protected:
+        virtual void run();
+    };
+
+    QString fname;
+    Compression compression;
+    Worker worker;
+
+    mutable QMutex mutex;
+    QWaitCondition readable, writable;
+    QQueue<QByteArray> blocks;
+    int blockOffset;
+    qint64 queued;
+    bool finished, aborted;
+    QString error;
+
+    bool push(const char * data, qint64 size);
+    void finish();
+    void fail(const QString & message);
+    void inflateGzip();
+    void inflateZstd();
+
+public:
+    DecompressStream(const QString & fname, Compression compression);
+    virtual ~DecompressStream();
+
+    virtual bool open(OpenMode mode);
+    virtual void close();
+    virtual bool isSequential() const;
+    virtual bool atEnd() const;
+    virtual qint64 bytesAvailable() const;
+
+    // why the file could not be inflated to its end, once reads run dry
+    QString failure() const;
+
+protected:
+    virtual qint64 readData(char * data, qint64 maxSize);
+    virtual qint64 writeData(const char * data, qint64 size);
+};
+
+// Opens a molecule file for reading, decompressing it on the fly if needed.
+// The caller owns the returned device; 0 if the file cannot be opened.
+QIODevice * openMoleculeFile(const QString & fname);
+
+// Why a device from openMoleculeFile ran dry before the end of the file,
+// or an empty string; errors past what was read are not looked for.
+QString decompressError(QIODevice & dev);
+
+// Reads a range of the decompressed contents. Seekable zstd files
+// only decompress the frames that cover the range.
+QByteArray readDecompressedRange(const QString & fname, qint64 offset, qint64 length);
+
+// Size and modification time of a file, to the nanosecond where the file
+// system keeps it, for telling whether it changed; empty if it is missing.
+QString fileStamp(const QString & fname);
+
+// File name without a .gz/.zst suffix.
+QString uncompressedName(const QString & fname);
+
+#endif // DECOMPRESS_H
@@ -0,0 +1,484 @@
+#include "embed.h"
+#include <QtConcurrentMap>
+#include <QThread>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const int iterations = 600;
+static const double skin = 0.5;
+static const double maxStep = 0.3;
+
+struct Range
+{
+    int first, last;
+};
+
+struct Embedding
+{
+    int n;
+    QVector<double> x, y, z;      // current positions
+    QVector<double> nx, ny, nz;   // next positions
+    QVector<bool> hydrogen;
+
+    // bond and angle restraints, per atom
+    QVector<int> rStart, rAtom;
+    QVector<double> rDist, rK;
+
+    QVector<QVector<int> > neighbors;
+    QVector<double> bx, by, bz;   // positions when the neighbors were listed
+    double step;
+};
+
+bool isFlat(const Molecule & molecule)
+{
+    if (molecule.atoms.count() < 3) return false;
+
+    foreach (const Atom & atom, molecule.atoms)
+        if (fabs(atom.z) > 1.0e-4) return false;
+
+    return true;
+}
+
+static double covalentRadius(const QString & element)
+{
+    static const struct { const char * element; double radius; } table[] = {
+        { "H", 0.31 }, { "C", 0.76 }, { "N", 0.71 }, { "O", 0.66 },
+        { "F", 0.57 }, { "P", 1.07 }, { "S", 1.05 }, { "Cl", 1.02 },
+        { "Br", 1.20 }, { "I", 1.39 }, { "Co", 1.26 }, { "Fe", 1.32 },
+        { 0, 0 }
+    };
+
+    for (int i = 0; table[i].element; ++i)
+        if (element == table[i].element) return table[i].radius;
+
+    return 0.75;
+}
+
+static double bondLength(const Molecule & molecule, const Bond & bond)
+{
+    double length = covalentRadius(molecule.atoms.at(bond.indexA).element)
+                  + covalentRadius(molecule.atoms.at(bond.indexB).element);
+
+    switch (bond.type)
+    {
+    case btDouble: return 0.87 * length;
+    case btTriple: return 0.78 * length;
+    case btAromatic: return 0.93 * length;
+    default: return length;
+    }
+}
+
+static void addRestraint(QVector<QVector<QPair<int, double> > > & lists, int a, int b, double d)
+{
+    lists[a].append(qMakePair(b, d));
+    lists[b].append(qMakePair(a, d));
+}
+
+static bool restrained(const Embedding & e, int i, int j)
+{
+    for (int k = e.rStart[i]; k < e.rStart[i + 1]; ++k)
+        if (e.rAtom[k] == j) return true;
+
+    return false;
+}
+
+// Minimum non-bonded distance; soft, so that crowded 2D
+// layouts can still pass through each other.
+static inline double contactDistance(const Embedding & e, int i, int j)
+{
+    if (e.hydrogen[i] && e.hydrogen[j]) return 1.8;
+    if (e.hydrogen[i] || e.hydrogen[j]) return 2.2;
+    return 2.8;
+}
+
+struct NeighborTask
+{
+    Embedding * e;
+    const QVector<int> * cellStart;
+    const QVector<int> * cellAtoms;
+    int dim[3];
+    double origin[3], cellSize;
+
+    typedef void result_type;
+
+    void operator()(const Range & range)
+    {
+        const double cutoff = 2.8 + skin;
+        const double cutoff2 = cutoff * cutoff;
+
+        for (int i = range.first; i < range.last; ++i)
+        {
+            QVector<int> & list = e->neighbors[i];
+            list.clear();
+
+            int c[3] = {
+                qBound(0, int((e->x[i] - origin[0]) / cellSize), dim[0] - 1),
+                qBound(0, int((e->y[i] - origin[1]) / cellSize), dim[1] - 1),
+                qBound(0, int((e->z[i] - origin[2]) / cellSize), dim[2] - 1)
+            };
+
+            for (int cx = qMax(c[0] - 1, 0); cx <= qMin(c[0] + 1, dim[0] - 1); ++cx)
+            for (int cy = qMax(c[1] - 1, 0); cy <= qMin(c[1] + 1, dim[1] - 1); ++cy)
+            for (int cz = qMax(c[2] - 1, 0); cz <= qMin(c[2] + 1, dim[2] - 1); ++cz)
+            {
+                int cell = (cx * dim[1] + cy) * dim[2] + cz;
+                for (int k = (*cellStart)[cell]; k < (*cellStart)[cell + 1]; ++k)
+                {
+                    int j = (*cellAtoms)[k];
+                    if (j == i) continue;
+
+                    double dx = e->x[i] - e->x[j];
+                    double dy = e->y[i] - e->y[j];
+                    double dz = e->z[i] - e->z[j];
+                    if (dx*dx + dy*dy + dz*dz < cutoff2 && !restrained(*e, i, j))
+                        list.append(j);
+                }
+            }
+        }
+    }
+};
+
+// Pair terms of one range in SoA form: the separation d, and for the
+// force k (rest - |d|) / |d| * d that applies while |d|^2 < limit.
+struct PairBuffers
+{
+    QVector<double> dx, dy, dz, rest, k, limit;
+
+    void resize(int n)
+    {
+        QVector<double> * all[] = { &dx, &dy, &dz, &rest, &k, &limit };
+        for (int i = 0; i < 6; ++i)
+            all[i]->resize(n);
+    }
+};
+
+// restraints hold at any distance
+static const double unlimited = 1.0e300;
+
+// replaces the separation of pair i with its force
+static inline void pairForce(PairBuffers & p, int i)
+{
+    double d2 = p.dx[i]*p.dx[i] + p.dy[i]*p.dy[i] + p.dz[i]*p.dz[i];
+    double d = sqrt(d2) + 1.0e-9;
+    double f = (d2 < p.limit[i]) ? p.k[i] * (p.rest[i] - d) / d : 0;
+    p.dx[i] *= f; p.dy[i] *= f; p.dz[i] *= f;
+}
+
+#ifdef __SSE2__
+// the same as pairForce(), for pairs i and i + 1
+static inline void pairForce2(PairBuffers & p, int i)
+{
+    __m128d dx = _mm_loadu_pd(&p.dx[i]), dy = _mm_loadu_pd(&p.dy[i]), dz = _mm_loadu_pd(&p.dz[i]);
+    __m128d d2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz));
+    __m128d d = _mm_add_pd(_mm_sqrt_pd(d2), _mm_set1_pd(1.0e-9));
+    __m128d f = _mm_div_pd(_mm_mul_pd(_mm_loadu_pd(&p.k[i]), _mm_sub_pd(_mm_loadu_pd(&p.rest[i]), d)), d);
+    f = _mm_and_pd(_mm_cmplt_pd(d2, _mm_loadu_pd(&p.limit[i])), f);
+
+    _mm_storeu_pd(&p.dx[i], _mm_mul_pd(dx, f));
+    _mm_storeu_pd(&p.dy[i], _mm_mul_pd(dy, f));
+    _mm_storeu_pd(&p.dz[i], _mm_mul_pd(dz, f));
+}
+#endif
+
+struct ForceTask
+{
+    Embedding * e;
+
+    typedef void result_type;
+
+    // Every atom gathers its own forces, so the ranges never write to
+    // shared data; pair terms are evaluated from both ends. The pairs are
+    // gathered first so that the force kernel runs over contiguous arrays.
+    void operator()(const Range & range)
+    {
+        const double * x = e->x.constData();
+        const double * y = e->y.constData();
+        const double * z = e->z.constData();
+
+        int n = e->rStart[range.last] - e->rStart[range.first];
+        for (int i = range.first; i < range.last; ++i)
+            n += e->neighbors[i].count();
+
+        PairBuffers p;
+        p.resize(n);
+        QVector<int> pairStart(range.last - range.first + 1);
+
+        int m = 0;
+        for (int i = range.first; i < range.last; ++i)
+        {
+            pairStart[i - range.first] = m;
+
+            for (int k = e->rStart[i]; k < e->rStart[i + 1]; ++k, ++m)
+            {
+                int j = e->rAtom[k];
+                p.dx[m] = x[i] - x[j]; p.dy[m] = y[i] - y[j]; p.dz[m] = z[i] - z[j];
+                p.rest[m] = e->rDist[k];
+                p.k[m] = e->rK[k];
+                p.limit[m] = unlimited;
+            }
+
+            const QVector<int> & list = e->neighbors[i];
+            for (int k = 0; k < list.count(); ++k, ++m)
+            {
+                int j = list[k];
+                double r = contactDistance(*e, i, j);
+                p.dx[m] = x[i] - x[j]; p.dy[m] = y[i] - y[j]; p.dz[m] = z[i] - z[j];
+                p.rest[m] = r;
+                p.k[m] = 0.2;
+                p.limit[m] = r * r;
+            }
+        }
+        pairStart[range.last - range.first] = m;
+
+        int k = 0;
+#ifdef __SSE2__
+        for (; k + 2 <= n; k += 2)
+            pairForce2(p, k);
+#endif
+        for (; k < n; ++k)
+            pairForce(p, k);
+
+        for (int i = range.first; i < range.last; ++i)
+        {
+            double fx = 0, fy = 0, fz = 0;
+            for (k = pairStart[i - range.first]; k < pairStart[i - range.first + 1]; ++k)
+            {
+                fx += p.dx[k]; fy += p.dy[k]; fz += p.dz[k];
+            }
+
+            fx *= e->step; fy *= e->step; fz *= e->step;
+            double len = sqrt(fx*fx + fy*fy + fz*fz);
+            if (len > maxStep)
+            {
+                fx *= maxStep / len; fy *= maxStep / len; fz *= maxStep / len;
+            }
+
+            e->nx[i] = x[i] + fx;
+            e->ny[i] = y[i] + fy;
+            e->nz[i] = z[i] + fz;
+        }
+    }
+};
+
+static void updateNeighbors(Embedding & e, QVector<Range> & ranges, bool parallel)
+{
+    double lo[3] = { e.x[0], e.y[0], e.z[0] };
+    double hi[3] = { e.x[0], e.y[0], e.z[0] };
+    for (int i = 1; i < e.n; ++i)
+    {
+        lo[0] = qMin(lo[0], e.x[i]); hi[0] = qMax(hi[0], e.x[i]);
+        lo[1] = qMin(lo[1], e.y[i]); hi[1] = qMax(hi[1], e.y[i]);
+        lo[2] = qMin(lo[2], e.z[i]); hi[2] = qMax(hi[2], e.z[i]);
+    }
+
+    NeighborTask task;
+    task.e = &e;
+    task.cellSize = 2.8 + skin;
+    for (int d = 0; d < 3; ++d)
+    {
+        task.origin[d] = lo[d];
+        task.dim[d] = qBound(1, int((hi[d] - lo[d]) / task.cellSize) + 1, 128);
+    }
+
+    // counting sort of atoms into cells
+    int cells = task.dim[0] * task.dim[1] * task.dim[2];
+    QVector<int> cellOf(e.n), cellStart(cells + 1, 0), cellAtoms(e.n);
+    for (int i = 0; i < e.n; ++i)
+    {
+        int cx = qBound(0, int((e.x[i] - lo[0]) / task.cellSize), task.dim[0] - 1);
+        int cy = qBound(0, int((e.y[i] - lo[1]) / task.cellSize), task.dim[1] - 1);
+        int cz = qBound(0, int((e.z[i] - lo[2]) / task.cellSize), task.dim[2] - 1);
+        cellOf[i] = (cx * task.dim[1] + cy) * task.dim[2] + cz;
+        ++cellStart[cellOf[i] + 1];
+    }
+    for (int c = 0; c < cells; ++c)
+        cellStart[c + 1] += cellStart[c];
+
+    QVector<int> fill = cellStart;
+    for (int i = 0; i < e.n; ++i)
+        cellAtoms[fill[cellOf[i]]++] = i;
+
+    task.cellStart = &cellStart;
+    task.cellAtoms = &cellAtoms;
+
+    if (parallel)
+        QtConcurrent::blockingMap(ranges, task);
+    else
+        foreach (const Range & range, ranges) task(range);
+
+    e.bx = e.x; e.by = e.y; e.bz = e.z;
+}
+
+// the lists hold every pair within the cutoff until some atom has moved
+// half the skin, as two atoms may then have closed the whole skin between them
+static bool neighborsStale(const Embedding & e)
+{
+    const double limit = (skin / 2) * (skin / 2);
+    for (int i = 0; i < e.n; ++i)
+    {
+        double dx = e.x[i] - e.bx[i], dy = e.y[i] - e.by[i], dz = e.z[i] - e.bz[i];
+        if (dx*dx + dy*dy + dz*dz > limit) return true;
+    }
+    return false;
+}
+
+static void setupRestraints(Embedding & e, const Molecule & molecule)
+{
+    QVector<QVector<QPair<int, double> > > lists(e.n);
+    QVector<QVector<QPair<int, double> > > angles(e.n);
+    QVector<QVector<int> > bonded(e.n);
+    QVector<int> multiple(e.n, 0), doubles(e.n, 0), triple(e.n, 0);
+
+    foreach (const Bond & bond, molecule.bonds)
+    {
+        if (bond.indexA == bond.indexB) continue;
+
+        addRestraint(lists, bond.indexA, bond.indexB, bondLength(molecule, bond));
+        bonded[bond.indexA].append(bond.indexB);
+        bonded[bond.indexB].append(bond.indexA);
+
+        if (bond.type == btDouble || bond.type == btAromatic)
+        {
+            ++multiple[bond.indexA];
+            ++multiple[bond.indexB];
+        }
+        if (bond.type == btDouble)
+        {
+            ++doubles[bond.indexA];
+            ++doubles[bond.indexB];
+        }
+        if (bond.type == btTriple)
+        {
+            ++triple[bond.indexA];
+            ++triple[bond.indexB];
+        }
+    }
+
+    // 1-3 distances from the bond angle at the center atom
+    for (int c = 0; c < e.n; ++c)
+    {
+        // linear for alkynes, nitriles and cumulenes; aromatic atoms
+        // are trigonal even with two explicit bonds
+        double angle = 109.47;
+        if (triple[c] || (doubles[c] >= 2 && bonded[c].count() == 2)) angle = 180;
+        else if (multiple[c]) angle = 120;
+
+        double cosAngle = cos(angle * M_PI / 180);
+        for (int p = 0; p < bonded[c].count(); ++p)
+        {
+            for (int q = p + 1; q < bonded[c].count(); ++q)
+            {
+                int i = bonded[c][p];
+                int j = bonded[c][q];
+                double a = 0, b = 0;
+                for (int k = 0; k < lists[c].count(); ++k)
+                {
+                    if (lists[c][k].first == i) a = lists[c][k].second;
+                    if (lists[c][k].first == j) b = lists[c][k].second;
+                }
+
+                double d = sqrt(a*a + b*b - 2*a*b*cosAngle);
+                angles[i].append(qMakePair(j, d));
+                angles[j].append(qMakePair(i, d));
+            }
+        }
+    }
+
+    e.rStart.resize(e.n + 1);
+    e.rStart[0] = 0;
+    for (int i = 0; i < e.n; ++i)
+    {
+        for (int k = 0; k < lists[i].count(); ++k)
+        {
+            e.rAtom.append(lists[i][k].first);
+            e.rDist.append(lists[i][k].second);
+            e.rK.append(1.0);
+        }
+        for (int k = 0; k < angles[i].count(); ++k)
+        {
+            e.rAtom.append(angles[i][k].first);
+            e.rDist.append(angles[i][k].second);
+            e.rK.append(0.5);
+        }
+        e.rStart[i + 1] = e.rAtom.count();
+    }
+}
+
+QVector<double> embed3D(const Molecule & molecule)
+{
+    Embedding e;
+    e.n = molecule.atoms.count();
+    if (e.n == 0) return QVector<double>();
+
+    e.x.resize(e.n); e.y.resize(e.n); e.z.resize(e.n);
+    e.nx.resize(e.n); e.ny.resize(e.n); e.nz.resize(e.n);
+    e.hydrogen.resize(e.n);
+    e.neighbors.resize(e.n);
+
+    setupRestraints(e, molecule);
+
+    // start from the 2D layout, scaled to real bond lengths
+    double layout = 0, real = 0;
+    foreach (const Bond & bond, molecule.bonds)
+    {
+        const Atom & a = molecule.atoms.at(bond.indexA);
+        const Atom & b = molecule.atoms.at(bond.indexB);
+        layout += sqrt((a.x-b.x)*(a.x-b.x) + (a.y-b.y)*(a.y-b.y) + (a.z-b.z)*(a.z-b.z));
+        real += bondLength(molecule, bond);
+    }
+    double scale = (layout > 0) ? real / layout : 1.0;
+
+    // a fixed seed keeps the result reproducible
+    quint32 seed = 12345;
+    for (int i = 0; i < e.n; ++i)
+    {
+        const Atom & atom = molecule.atoms.at(i);
+        seed = seed * 1664525u + 1013904223u;
+        e.x[i] = atom.x * scale;
+        e.y[i] = atom.y * scale;
+        e.z[i] = atom.z * scale + ((seed >> 8) / double(1 << 24) - 0.5);
+        e.hydrogen[i] = (atom.element == "H");
+    }
+
+    bool parallel = e.n >= 256;
+    int taskCount = parallel ? QThread::idealThreadCount() * 2 : 1;
+    QVector<Range> ranges(taskCount);
+    for (int t = 0; t < taskCount; ++t)
+    {
+        ranges[t].first = (qint64) e.n * t / taskCount;
+        ranges[t].last = (qint64) e.n * (t + 1) / taskCount;
+    }
+
+    ForceTask forces;
+    forces.e = &e;
+    for (int it = 0; it < iterations; ++it)
+    {
+        if (it == 0 || neighborsStale(e))
+            updateNeighbors(e, ranges, parallel);
+
+        // large steps first, then settle
+        e.step = 0.5 * (1.0 - 0.8 * it / iterations);
+
+        if (parallel)
+            QtConcurrent::blockingMap(ranges, forces);
+        else
+            forces(ranges[0]);
+
+        qSwap(e.x, e.nx);
+        qSwap(e.y, e.ny);
+        qSwap(e.z, e.nz);
+    }
+
+    QVector<double> result(3 * e.n);
+    for (int i = 0; i < e.n; ++i)
+    {
+        result[3*i] = e.x[i];
+        result[3*i + 1] = e.y[i];
+        result[3*i + 2] = e.z[i];
+    }
+
+    return result;
+}
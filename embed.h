@@ -0,0 +1,17 @@
+#ifndef EMBED_H
+#define EMBED_H
+
+#include <QVector>
+#include "molecule.h"
+
+// true if all atoms lie in the z = 0 plane, as in 2D depictions
+bool isFlat(const Molecule & molecule);
+
+// Generates 3D coordinates (x, y, z per atom) from the bond graph. Bond
+// lengths and angles are derived from elements and bond orders and used
+// as distance restraints, starting from the 2D layout lifted slightly out
+// of plane; a soft non-bonded repulsion on cell-based neighbor lists then
+// relaxes the structure. Larger molecules are relaxed on all cores.
+QVector<double> embed3D(const Molecule & molecule);
+
+#endif // EMBED_H
@@ -1,10 +1,29 @@
 #include "glwidget.h"
+#include "brickstore.h"
 #include "GL/glut.h"
 #include "GL/glu.h"
 #include <QRgb>
+#include <QElapsedTimer>
+#include <algorithm>
 
 static const double PI = 3.1415926536;
 
+// atoms and bonds per display list
+static const int chunkSize = 1024;
+
+// offsets of the lines of double and triple bonds from the bond axis; the
+// cylinders come out at the same spacing in every render mode
+static const float doubleBondSpacing = 0.0875;
+static const float tripleBondSpacing = 0.105;
+
+// brick display lists compiled per frame, so panning stays smooth
+static const int bricksPerFrame = 4;
+
+static inline double sqr(double x)
+{
+    return x*x;
+}
+
 struct ElmRec { QString name; Element elm; };
 
 ElmRec elemRec[] = {
@@ -29,6 +48,48 @@ Element::Element(double radius, QColor color, QColor anaColor)
     this->anaColor = anaColor.isValid() ? anaColor : color;
 }
 
+// GL_ARB_timer_query / GL_EXT_timer_query, resolved at run time
+struct GpuTimer
+{
+    typedef void (APIENTRY *GenQueries)(GLsizei n, GLuint * ids);
+    typedef void (APIENTRY *BeginQuery)(GLenum target, GLuint id);
+    typedef void (APIENTRY *EndQuery)(GLenum target);
+    typedef void (APIENTRY *GetQueryObjectui64v)(GLuint id, GLenum pname, quint64 * params);
+
+    bool resolved;
+    GLuint query;
+    GenQueries genQueries;
+    BeginQuery beginQuery;
+    EndQuery endQuery;
+    GetQueryObjectui64v getQueryObjectui64v;
+
+    GpuTimer() : resolved(false), query(0), getQueryObjectui64v(0) {}
+
+    bool available(const QGLContext * context)
+    {
+        if (!resolved)
+        {
+            resolved = true;
+            QByteArray extensions = (const char *) glGetString(GL_EXTENSIONS);
+            if (!extensions.contains("GL_ARB_timer_query") && !extensions.contains("GL_EXT_timer_query"))
+                return false;
+
+            genQueries = (GenQueries) context->getProcAddress("glGenQueries");
+            beginQuery = (BeginQuery) context->getProcAddress("glBeginQuery");
+            endQuery = (EndQuery) context->getProcAddress("glEndQuery");
+            getQueryObjectui64v = (GetQueryObjectui64v) context->getProcAddress("glGetQueryObjectui64v");
+            if (!getQueryObjectui64v)
+                getQueryObjectui64v = (GetQueryObjectui64v) context->getProcAddress("glGetQueryObjectui64vEXT");
+
+            if (genQueries && beginQuery && endQuery && getQueryObjectui64v)
+                genQueries(1, &query);
+            else
+                getQueryObjectui64v = 0;
+        }
+        return getQueryObjectui64v != 0;
+    }
+};
+
 GLWidget::GLWidget(QWidget *parent)
     : QGLWidget(parent)
 {
@@ -41,6 +102,25 @@ GLWidget::GLWidget(QWidget *parent)
     eyeDistance = 100;
     renderMode = rmSmall;
     mousingMode = mmNone;
+    frameBuffer = 0;
+    stereoMode = smTwoPass;
+    reprojection = 0;
+    reprojectionFailed = false;
+    colorTexture = depthTexture = 0;
+    gpuTimer = 0;
+    glReady = false;
+    stickSpheres[0] = cylinders[0][0] = 0;
+    sceneBudget = qint64(256) << 20;
+    sceneBytes = 0;
+    sceneClock = 0;
+    bricks = 0;
+    brickCache = 0;
+    brickBudget = qint64(512) << 20;
+    bricksCompiled = 0;
+
+    morphTimer = new QTimer(this);
+    morphTimer->setInterval(20);
+    connect(morphTimer, SIGNAL(timeout()), this, SLOT(morphStep()));
 
     Molecule mol("molecules/thujone.mol");
     setMolecule(mol);
@@ -162,31 +242,35 @@ void GLWidget::setScale(int value)
     update();
 }
 
+// the chunks call the shared sphere and material lists,
+// so only those need recompiling
 void GLWidget::setAtomSizeScale(int value)
 {
     atomSizeScale = value / 100.0;
-    recacheObject();
+    if (glReady)
+    {
+        makeCurrent();
+        compileSpheres();
+    }
     update();
 }
 
 void GLWidget::setAnaglyph(bool anaglyph)
 {
     this->anaglyph = anaglyph;
-    recacheObject();
+    if (glReady)
+    {
+        makeCurrent();
+        compileMaterials();
+    }
     update();
 }
 
 void GLWidget::setMoleculeSize(int size)
 {
-    switch (size)
-    {
-    case 0:
-        renderMode = rmSmall; break;
-    case 1:
-        renderMode = rmLarge; break;
-    case 2: default:
-        renderMode = rmGiant; break;
-    }
+    RenderMode mode = (size == 0) ? rmSmall : (size == 1) ? rmLarge : rmGiant;
+    if (mode == renderMode) return;
+    renderMode = mode;
 
     recacheObject();
     update();
@@ -202,12 +286,48 @@ GLWidget::~GLWidget()
 {
     makeCurrent();
     glDeleteLists(object, 1);
+    foreach (GLuint list, chunks)
+        glDeleteLists(list, 1);
+    foreach (const Scene & scene, scenes)
+        deleteScene(scene);
+    foreach (const ElementLists & lists, elementLists)
+    {
+        glDeleteLists(lists.material, 1);
+        glDeleteLists(lists.spheres[0], 3);
+    }
+    glDeleteLists(stickSpheres[0], 3);
+    glDeleteLists(cylinders[0][0], 6);
+    if (brickCache)
+        brickCache->clear();
+    delete brickCache;
+    delete bricks;
+    delete frameBuffer;
+    delete reprojection;
+    delete gpuTimer;
+    if (colorTexture)
+    {
+        glDeleteTextures(1, &colorTexture);
+        glDeleteTextures(1, &depthTexture);
+    }
 }
 
 void GLWidget::initializeGL()
 {
     qglClearColor(Qt::gray);
     object = 0;
+    chunks.clear();
+    scenes.clear();
+    delete reprojection;
+    reprojection = 0;
+    reprojectionFailed = false;
+    colorTexture = depthTexture = 0;
+    sceneBytes = 0;
+
+    // query objects and entry points belong to the context
+    delete gpuTimer;
+    gpuTimer = new GpuTimer;
+    if (brickCache)
+        brickCache->clear();
 
     glShadeModel(GL_SMOOTH);
     glEnable(GL_DEPTH_TEST);
@@ -228,7 +348,14 @@ void GLWidget::initializeGL()
     glEnable(GL_LIGHTING);    /* enable lighting */
     glEnable(GL_LIGHT0);        /* enable light 0 */
 
+    elementLists.clear();
+    stickSpheres[0] = cylinders[0][0] = 0;
+    compileMaterials();
+    compileSpheres();
+    compileCylinders();
+
     recacheObject();
+    glReady = true;
 }
 
 void GLWidget::renderImage()
@@ -238,15 +365,171 @@ void GLWidget::renderImage()
     glRotated(xRot, 1.0, 0.0, 0.0);
     glRotated(zRot, 0.0, 0.0, 1.0);
     glTranslated(-molecule.massCenterX, -molecule.massCenterY, -molecule.massCenterZ);
-    glCallList(object);
+
+    if (brickCache)
+        drawBricks();
+    else
+        glCallList(object);
+}
+
+static bool nearestFirst(const QPair<double, int> & a, const QPair<double, int> & b)
+{
+    return a.first < b.first;
+}
+
+void GLWidget::drawBricks()
+{
+    GLdouble mv[16], pr[16];
+    GLint viewport[4];
+    glGetDoublev(GL_MODELVIEW_MATRIX, mv);
+    glGetDoublev(GL_PROJECTION_MATRIX, pr);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    // the view is rotated and uniformly scaled, so any column gives the scale
+    double viewScale = sqrt(mv[0]*mv[0] + mv[1]*mv[1] + mv[2]*mv[2]);
+    double focal = 0.5 * viewport[3] / tan(30 * PI / 180);
+
+    // bricks whose boxes are not entirely outside one clip plane, by depth
+    QList<QPair<double, int> > visible;
+    for (int i = 0; i < bricks->brickCount(); ++i)
+    {
+        const BrickInfo & info = bricks->brick(i);
+        int outside[6] = { 0, 0, 0, 0, 0, 0 };
+        for (int c = 0; c < 8; ++c)
+        {
+            double p[3] = { (c & 1) ? info.hi[0] : info.lo[0],
+                            (c & 2) ? info.hi[1] : info.lo[1],
+                            (c & 4) ? info.hi[2] : info.lo[2] };
+            double e[4], clip[4];
+            for (int r = 0; r < 4; ++r)
+                e[r] = mv[r]*p[0] + mv[4 + r]*p[1] + mv[8 + r]*p[2] + mv[12 + r];
+            for (int r = 0; r < 4; ++r)
+                clip[r] = pr[r]*e[0] + pr[4 + r]*e[1] + pr[8 + r]*e[2] + pr[12 + r]*e[3];
+
+            for (int k = 0; k < 3; ++k)
+            {
+                if (clip[k] < -clip[3]) ++outside[2*k];
+                if (clip[k] > clip[3]) ++outside[2*k + 1];
+            }
+        }
+
+        bool culled = false;
+        for (int k = 0; k < 6; ++k)
+            culled = culled || outside[k] == 8;
+        if (culled) continue;
+
+        double cx = 0.5 * (info.lo[0] + info.hi[0]);
+        double cy = 0.5 * (info.lo[1] + info.hi[1]);
+        double cz = 0.5 * (info.lo[2] + info.hi[2]);
+        double depth = -(mv[2]*cx + mv[6]*cy + mv[10]*cz + mv[14]);
+        visible.append(qMakePair(depth, i));
+    }
+    qSort(visible.begin(), visible.end(), nearestFirst);
+
+    bool incomplete = false;
+    for (int v = 0; v < visible.count(); ++v)
+    {
+        int i = visible[v].second;
+        const Molecule * brick = brickCache->request(i);
+        if (!brick)
+        {
+            incomplete = true;
+            continue;
+        }
+
+        // level of detail by the projected size of the brick
+        const BrickInfo & info = bricks->brick(i);
+        double radius = 0.5 * viewScale * sqrt(sqr(info.hi[0] - info.lo[0])
+            + sqr(info.hi[1] - info.lo[1]) + sqr(info.hi[2] - info.lo[2]));
+        double pixels = focal * radius / qMax(0.01, visible[v].first);
+        int lod = pixels > 600 ? rmSmall : pixels > 150 ? rmLarge : rmGiant;
+        lod = qMax<int>(lod, renderMode);
+
+        GLuint & list = brickCache->list(i, lod);
+        if (!list && bricksCompiled < bricksPerFrame)
+        {
+            const double atomBytes[3] = { 14000, 2000, 400 };
+            const double bondBytes[3] = { 5000, 1500, 48 };
+
+            BondInstances geometry;
+            bondInstances(brick->bonds, doubleBondSpacing, tripleBondSpacing, geometry);
+
+            list = glGenLists(1);
+            glNewList(list, GL_COMPILE);
+            smallObject(*brick, geometry, 0, (RenderMode) lod, 0, qMax(brick->atoms.count(), brick->bonds.count()));
+            glEndList();
+
+            brickCache->addBytes(i, qint64(brick->atoms.count() * atomBytes[lod]
+                + brick->bonds.count() * bondBytes[lod]));
+            ++bricksCompiled;
+        }
+
+        // a coarser list stands in until this one is compiled
+        GLuint shown = list;
+        for (int k = rmGiant; !shown && k >= rmSmall; --k)
+            shown = brickCache->list(i, k);
+
+        if (shown)
+            glCallList(shown);
+        if (shown != list)
+            incomplete = true;
+    }
+
+    brickCache->trim();
+    if (incomplete && bricksCompiled)
+        update();
+}
+
+void GLWidget::setBrickStore(BrickStore * store)
+{
+    if (!store && !bricks) return;
+
+    makeCurrent();
+    if (brickCache)
+        brickCache->clear();
+    delete brickCache;
+    delete bricks;
+
+    bricks = store;
+    brickCache = 0;
+
+    Molecule empty;
+    if (store)
+    {
+        brickCache = new BrickCache(store, brickBudget, this);
+        connect(brickCache, SIGNAL(loaded()), this, SLOT(update()));
+
+        empty.massCenterX = store->centerX();
+        empty.massCenterY = store->centerY();
+        empty.massCenterZ = store->centerZ();
+    }
+    setMolecule(empty);
+}
+
+void GLWidget::setBrickBudget(int megabytes)
+{
+    brickBudget = qint64(megabytes) << 20;
+    if (brickCache)
+        brickCache->setBudget(brickBudget);
 }
 
 void GLWidget::paintGL()
 {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    if (brickCache)
+        brickCache->beginFrame();
+    bricksCompiled = 0;
 
     const double zShift = 7;
-    if (anaglyph)
+    if (anaglyph && stereoMode == smReprojected && prepareReprojection())
+    {
+        glLoadIdentity();
+        glTranslated(-panX, -panY, -panZ);
+        glTranslated(0, 0, -zShift);
+        renderImage();
+        reprojectAnaglyph(zShift);
+    }
+    else if (anaglyph)
     {
         const double xShift = 0.001 * eyeDistance;
         const double convRot = 180 * atan(xShift/zShift) / 3.1415926536;
@@ -278,172 +561,611 @@ void GLWidget::paintGL()
         glTranslated(0, 0, -zShift);
         renderImage();
     }
+
+    emit frameDrawn();
 }
 
-void GLWidget::setMolecule(const Molecule &molecule)
+// Each eye sees a point at distance d shifted by shift * (1/d - convergence)
+// in texture units, which matches the toed-in cameras of the two-pass
+// mode. Every output pixel searches its row for the nearest source pixel
+// that lands on it; where none does (a disocclusion), the farthest one
+// landing close by fills the hole, stretching the background.
+static const char * reprojectionShader =
+    "uniform sampler2D color;\n"
+    "uniform sampler2D depth;\n"
+    "uniform float shift;\n"
+    "uniform float convergence;\n"
+    "uniform float zNear;\n"
+    "uniform float zFar;\n"
+    "uniform float range;\n"
+    "\n"
+    "float parallax(float d)\n"
+    "{\n"
+    "    float z = 2.0 * d - 1.0;\n"
+    "    float dist = 2.0 * zNear * zFar / (zFar + zNear - z * (zFar - zNear));\n"
+    "    return d < 1.0 ? shift * (1.0 / dist - convergence) : 0.0;\n"
+    "}\n"
+    "\n"
+    "vec4 reproject(vec2 uv, float side)\n"
+    "{\n"
+    "    const int steps = 24;\n"
+    "    float tolerance = range / float(steps - 1);\n"
+    "    bool found = false;\n"
+    "    float best = uv.x, bestDepth = 2.0;\n"
+    "    float hole = uv.x, holeDepth = -1.0;\n"
+    "\n"
+    "    for (int i = 0; i < steps; ++i)\n"
+    "    {\n"
+    "        float s = uv.x + range * (2.0 * float(i) / float(steps - 1) - 1.0);\n"
+    "        float d = texture2D(depth, vec2(s, uv.y)).r;\n"
+    "        float err = abs(s + side * parallax(d) - uv.x);\n"
+    "        if (err <= tolerance && d < bestDepth) { found = true; best = s; bestDepth = d; }\n"
+    "        if (err <= 2.0 * tolerance && d > holeDepth) { hole = s; holeDepth = d; }\n"
+    "    }\n"
+    "\n"
+    "    if (!found) return texture2D(color, vec2(hole, uv.y));\n"
+    "\n"
+    "    // one fixed-point step to the exact source\n"
+    "    float s = uv.x - side * parallax(bestDepth);\n"
+    "    float d = texture2D(depth, vec2(s, uv.y)).r;\n"
+    "    if (abs(s + side * parallax(d) - uv.x) < abs(best + side * parallax(bestDepth) - uv.x))\n"
+    "        best = s;\n"
+    "    return texture2D(color, vec2(best, uv.y));\n"
+    "}\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    vec2 uv = gl_TexCoord[0].xy;\n"
+    "    float red = reproject(uv, 1.0).r;\n"
+    "    vec3 cyan = reproject(uv, -1.0).rgb;\n"
+    "    gl_FragColor = vec4(red, cyan.g, cyan.b, 1.0);\n"
+    "}\n";
+
+void GLWidget::setStereoMode(StereoMode mode)
 {
-    this->molecule = molecule;
-    recacheObject();
+    stereoMode = mode;
     update();
 }
 
-static void drawLineBond(BondType type)
+StereoMode GLWidget::getStereoMode()
 {
-    glColor3f(1,1,1);
-    glBegin(GL_LINES);
-    switch (type)
-    {
-    case btSingle:
-        glVertex3f(0,0,0); glVertex3f(1,0,0);
-        break;
+    return stereoMode;
+}
 
-    case btDouble:
-        glVertex3f(0,-0.0875,0); glVertex3f(1,-0.0875,0);
-        glVertex3f(0,0.0875,0); glVertex3f(1,0.0875,0);
-        break;
+bool GLWidget::prepareReprojection()
+{
+    if (reprojectionFailed) return false;
 
-    case btTriple:
-        glVertex3f(0,-0.105,0); glVertex3f(1,-0.105,0);
-        glVertex3f(0,0,0); glVertex3f(1,0,0);
-        glVertex3f(0,0.105,0); glVertex3f(1,0.105,0);
-        break;
+    if (!reprojection)
+    {
+        reprojection = new QGLShaderProgram(context(), this);
+        if (!reprojection->addShaderFromSourceCode(QGLShader::Fragment, reprojectionShader)
+            || !reprojection->link())
+        {
+            qWarning("Reprojected anaglyph not available: %s", qPrintable(reprojection->log()));
+            reprojectionFailed = true;
+            return false;
+        }
+    }
 
-    default:
-        glVertex3f(0,0,0); glVertex3f(1,0,0);
-        break;
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    QSize size(viewport[2], viewport[3]);
+    if (colorTexture && size == textureSize)
+        return true;
+
+    if (!colorTexture)
+    {
+        glGenTextures(1, &colorTexture);
+        glGenTextures(1, &depthTexture);
     }
+
+    glBindTexture(GL_TEXTURE_2D, colorTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size.width(), size.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+
+    glBindTexture(GL_TEXTURE_2D, depthTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size.width(), size.height(), 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 0);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    textureSize = size;
+    return true;
+}
+
+void GLWidget::reprojectAnaglyph(double zShift)
+{
+    GLint viewport[4];
+    GLdouble projection[16];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetDoublev(GL_PROJECTION_MATRIX, projection);
+
+    // the center view, as rendered
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, depthTexture);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, viewport[0], viewport[1], viewport[2], viewport[3]);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, colorTexture);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, viewport[0], viewport[1], viewport[2], viewport[3]);
+
+    glPushAttrib(GL_ENABLE_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_CULL_FACE);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    // half the NDC shift per unit of inverse distance, for an eye
+    // displaced as in the two-pass mode
+    double eye = 0.001 * eyeDistance;
+    double shift = 0.5 * projection[0] * eye;
+
+    reprojection->bind();
+    reprojection->setUniformValue("color", 0);
+    reprojection->setUniformValue("depth", 1);
+    reprojection->setUniformValue("shift", GLfloat(shift));
+    reprojection->setUniformValue("convergence", GLfloat(1 / zShift));
+    reprojection->setUniformValue("zNear", GLfloat(projection[14] / (projection[10] - 1)));
+    reprojection->setUniformValue("zFar", GLfloat(projection[14] / (projection[10] + 1)));
+    // parallax of points three times nearer than the convergence plane
+    reprojection->setUniformValue("range", GLfloat(qMax(2 * shift / zShift, 4.0 / viewport[2])));
+
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 0); glVertex2f(-1, -1);
+    glTexCoord2f(1, 0); glVertex2f(1, -1);
+    glTexCoord2f(1, 1); glVertex2f(1, 1);
+    glTexCoord2f(0, 1); glVertex2f(-1, 1);
     glEnd();
+
+    reprojection->release();
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopAttrib();
 }
 
-static void drawBond(BondType type, RenderMode renderMode)
+bool CameraState::operator==(const CameraState & other) const
 {
-    static GLUquadric *quad = gluNewQuadric();
-    double baseRadius = 0.01;
-    double bondDistanceC = 1.75;
-
-    int slices = 12;
-    int stacks = 4;
-    switch (renderMode)
-    {
-    case rmSmall:
-        slices = 12; stacks = 4; break;
-    case rmLarge:
-        slices = 8; stacks = 2;
-        baseRadius *= 0.5;
-        bondDistanceC *= 2;
-        break;
-    case rmGiant:
-        drawLineBond(type);
-        return;
+    return xRot == other.xRot && yRot == other.yRot && zRot == other.zRot
+        && scale == other.scale && panX == other.panX && panY == other.panY && panZ == other.panZ
+        && eyeDistance == other.eyeDistance && moleculeSize == other.moleculeSize
+        && anaglyph == other.anaglyph;
+}
+
+CameraState GLWidget::cameraState()
+{
+    CameraState state;
+    state.xRot = xRot;
+    state.yRot = yRot;
+    state.zRot = zRot;
+    state.scale = scale;
+    state.panX = panX;
+    state.panY = panY;
+    state.panZ = panZ;
+    state.eyeDistance = eyeDistance;
+    state.moleculeSize = renderMode;
+    state.anaglyph = anaglyph;
+    return state;
+}
+
+void GLWidget::setCameraState(const CameraState & state)
+{
+    // the sliders set whole degrees back, so they go first
+    emit xRotChanged(lround(state.xRot));
+    emit yRotChanged(lround(state.yRot));
+    emit zRotChanged(lround(state.zRot));
+    emit scaleChanged((int) (100 * state.scale));
+
+    xRot = state.xRot;
+    yRot = state.yRot;
+    zRot = state.zRot;
+    scale = state.scale;
+    panX = state.panX;
+    panY = state.panY;
+    panZ = state.panZ;
+    eyeDistance = state.eyeDistance;
+
+    setMoleculeSize(state.moleculeSize);
+    if (state.anaglyph != anaglyph)
+        setAnaglyph(state.anaglyph);
+
+    update();
+}
+
+FrameTiming GLWidget::profileFrame()
+{
+    const GLenum timeElapsed = 0x88BF; // GL_TIME_ELAPSED
+    const GLenum queryResult = 0x8866; // GL_QUERY_RESULT
+    if (!glReady)
+        glInit();
+    makeCurrent();
+    GpuTimer & gpu = *gpuTimer;
+
+    bool timed = gpu.available(context());
+    if (timed)
+        gpu.beginQuery(timeElapsed, gpu.query);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    paintGL();
+
+    FrameTiming timing;
+    timing.cpuMs = timer.nsecsElapsed() / 1.0e6;
+    timing.gpuMs = -1;
+
+    if (timed)
+        gpu.endQuery(timeElapsed);
+    glFinish();
+    timing.totalMs = timer.nsecsElapsed() / 1.0e6;
+
+    if (timed)
+    {
+        quint64 ns = 0;
+        gpu.getQueryObjectui64v(gpu.query, queryResult, &ns);
+        timing.gpuMs = ns / 1.0e6;
     }
 
-    double singleBondRadius = 7 * baseRadius;
-    double doubleBondRadius = 5 * baseRadius;
-    double tripleBondRadius = 4 * baseRadius;
+    swapBuffers();
+    return timing;
+}
 
-    glRotatef(90, 1, 0, 0);
-    glRotatef(90, 0, 1, 0);
+QImage GLWidget::renderFrame(int width, int height)
+{
+    if (!glReady)
+        glInit();
 
-    switch (type)
+    makeCurrent();
+    if (!frameBuffer || frameBuffer->size() != QSize(width, height))
     {
-    case btSingle:
-        gluCylinder(quad, singleBondRadius, singleBondRadius, 1, 12, 4);
-        break;
+        delete frameBuffer;
+        frameBuffer = new QGLFramebufferObject(width, height, QGLFramebufferObject::Depth);
+    }
 
-    case btDouble:
-        glTranslatef(-bondDistanceC*doubleBondRadius,0,0);
-        gluCylinder(quad, doubleBondRadius, doubleBondRadius, 1, 12, 4);
-        glTranslatef(2*bondDistanceC*doubleBondRadius,0,0);
-        gluCylinder(quad, doubleBondRadius, doubleBondRadius, 1, 12, 4);
-        break;
+    frameBuffer->bind();
+    resizeGL(width, height);
+    paintGL();
+    frameBuffer->release();
 
-    case btTriple:
-        gluCylinder(quad, tripleBondRadius, tripleBondRadius, 1, 12, 4);
-        glTranslatef(-1.5*bondDistanceC*tripleBondRadius,0,0);
-        gluCylinder(quad, tripleBondRadius, tripleBondRadius, 1, 12, 4);
-        glTranslatef(3*bondDistanceC*tripleBondRadius,0,0);
-        gluCylinder(quad, tripleBondRadius, tripleBondRadius, 1, 12, 4);
-        break;
+    if (this->height() > 0)
+        resizeGL(this->width(), this->height());
 
-    default:
-        gluCylinder(quad, singleBondRadius, singleBondRadius, 1, 12, 4);
-        break;
+    return frameBuffer->toImage();
+}
+
+void GLWidget::animateTo(const QVector<double> & coords)
+{
+    if (coords.count() != 3 * molecule.atoms.count()) return;
+
+    morphFrom.resize(coords.count());
+    for (int i = 0; i < molecule.atoms.count(); ++i)
+    {
+        const Atom & atom = molecule.atoms.at(i);
+        morphFrom[3*i] = atom.x;
+        morphFrom[3*i + 1] = atom.y;
+        morphFrom[3*i + 2] = atom.z;
     }
+    morphTarget = coords;
+
+    morphClock.start();
+    morphTimer->start();
 }
 
-static inline double sqr(double x)
+void GLWidget::morphStep()
 {
-    return x*x;
+    const double duration = 1000;
+    morphTo(qMin(1.0, morphClock.elapsed() / duration));
 }
 
-static void stretchBond(const Atom &a, const Atom &b)
+// a scene put away mid-morph keeps the coordinates it was heading to
+void GLWidget::finishMorph()
 {
-    double dXYZ = sqrt(sqr(a.x - b.x) + sqr(a.y - b.y) + sqr(a.z - b.z));
-    double dXZ = sqrt(sqr(a.x - b.x) + sqr(a.z - b.z));
+    if (morphTimer->isActive())
+        morphTo(1);
+}
+
+void GLWidget::morphTo(double t)
+{
+    double s = t * t * (3 - 2 * t);
 
-    if (dXYZ < 1.0e-8)
+    // the atoms may still be shared with a copy that the bonds point into
+    if (!molecule.atoms.isDetached())
+        molecule.detach();
+
+    QVector<int> moved;
+    double cx = 0, cy = 0, cz = 0;
+    for (int i = 0; i < molecule.atoms.count(); ++i)
     {
-        glScalef(0,0,0);
-        return;
+        Atom & atom = molecule.atoms[i];
+        double x = morphFrom[3*i] + s * (morphTarget[3*i] - morphFrom[3*i]);
+        double y = morphFrom[3*i + 1] + s * (morphTarget[3*i + 1] - morphFrom[3*i + 1]);
+        double z = morphFrom[3*i + 2] + s * (morphTarget[3*i + 2] - morphFrom[3*i + 2]);
+        if (x != atom.x || y != atom.y || z != atom.z)
+        {
+            atom.x = x;
+            atom.y = y;
+            atom.z = z;
+            moved.append(i);
+        }
+
+        cx += atom.x; cy += atom.y; cz += atom.z;
+    }
+
+    if (!molecule.atoms.isEmpty())
+    {
+        molecule.massCenterX = cx / molecule.atoms.count();
+        molecule.massCenterY = cy / molecule.atoms.count();
+        molecule.massCenterZ = cz / molecule.atoms.count();
     }
 
-    double phi = 0;
-    double alpha = (b.y > a.y) ? PI/2 : -PI/2;
+    if (t >= 1)
+        morphTimer->stop();
 
-    if (dXZ > 1.0e-8)
+    // the bond graph is unchanged; only chunks with moved atoms recompile
+    patchMolecule(molecule, moved, QVector<int>());
+    update();
+}
+
+void GLWidget::setMolecule(const Molecule &molecule, const QString & key)
+{
+    if (!sceneKey.isEmpty() && sceneKey != key)
+        stashScene();
+    morphTimer->stop();
+    sceneKey = key;
+
+    QHash<QString, Scene>::iterator it = scenes.find(key);
+    if (it != scenes.end())
     {
-        double dX = b.x - a.x;
-        double dY = b.y - a.y;
-        double dZ = b.z - a.z;
+        sceneBytes -= it->bytes;
+        deleteScene(*it);
+        scenes.erase(it);
+    }
 
-        phi = asin(dZ/dXZ);
-        if (dX < 0) phi = PI - phi;
+    this->molecule = molecule;
+    atomStates.flags.clear();
+    recacheObject();
+    update();
+}
 
-        alpha = asin(dY/dXYZ);
+bool GLWidget::showScene(const QString & key)
+{
+    if (key.isEmpty()) return false;
+    if (key == sceneKey) return true;
+
+    QHash<QString, Scene>::iterator it = scenes.find(key);
+    if (it == scenes.end()) return false;
+
+    // taken out first, so that stashing the current scene cannot trim it
+    Scene scene = *it;
+    sceneBytes -= scene.bytes;
+    scenes.erase(it);
+
+    if (!sceneKey.isEmpty())
+        stashScene();
+    else
+        deleteLists();
+    morphTimer->stop();
+    sceneKey = key;
+
+    molecule = scene.molecule;
+    object = scene.object;
+    chunks = scene.chunks;
+    bondGeometry = scene.bondGeometry;
+    atomStates = scene.atomStates;
+    atomBondStart = scene.atomBondStart;
+    atomBonds = scene.atomBonds;
+
+    if (scene.renderMode != renderMode)
+    {
+        makeCurrent();
+        recacheObject();
     }
+    update();
+    return true;
+}
 
-    glTranslatef(a.x, a.y, a.z);
-    glRotatef(phi*180/PI, 0, -1, 0);
-    glRotatef(alpha*180/PI, 0, 0, 1);
-    glScalef(dXYZ, 1, 1);
+void GLWidget::setSceneBudget(int megabytes)
+{
+    sceneBudget = qint64(megabytes) << 20;
+    trimScenes();
 }
 
-void GLWidget::smallObject(RenderMode renderMode)
+// moves the current lists into the cache; recacheObject() starts afresh
+void GLWidget::stashScene()
 {
-    // draw bonds
-    foreach (Bond bond, molecule.bonds)
+    finishMorph();
+
+    Scene scene;
+    scene.molecule = molecule;
+    scene.object = object;
+    scene.chunks = chunks;
+    scene.bondGeometry = bondGeometry;
+    scene.atomStates = atomStates;
+    scene.atomBondStart = atomBondStart;
+    scene.atomBonds = atomBonds;
+    scene.renderMode = renderMode;
+    scene.lastUse = ++sceneClock;
+
+    // rough size of the compiled lists and the data kept for patching
+    int instances = bondGeometry.start.isEmpty() ? 0 : bondGeometry.start.last();
+    scene.bytes = molecule.atoms.count() * (sizeof(Atom) + 64 + 96)
+        + molecule.bonds.count() * (sizeof(Bond) + 16)
+        + instances * (64 + 96);
+
+    if (scenes.contains(sceneKey))
     {
-        glPushMatrix();
-        stretchBond(*bond.a, *bond.b);
-        drawBond(bond.type, renderMode);
-        glPopMatrix();
+        sceneBytes -= scenes[sceneKey].bytes;
+        deleteScene(scenes[sceneKey]);
+    }
+    scenes.insert(sceneKey, scene);
+    sceneBytes += scene.bytes;
+
+    object = 0;
+    chunks.clear();
+    trimScenes();
+}
+
+void GLWidget::deleteLists()
+{
+    makeCurrent();
+    if (object)
+        glDeleteLists(object, 1);
+    foreach (GLuint list, chunks)
+        glDeleteLists(list, 1);
+
+    object = 0;
+    chunks.clear();
+}
+
+void GLWidget::deleteScene(const Scene & scene)
+{
+    makeCurrent();
+    if (scene.object)
+        glDeleteLists(scene.object, 1);
+    foreach (GLuint list, scene.chunks)
+        glDeleteLists(list, 1);
+}
+
+static bool byLastUse(const QPair<int, QString> & a, const QPair<int, QString> & b)
+{
+    return a.first < b.first;
+}
+
+void GLWidget::trimScenes()
+{
+    if (sceneBytes <= sceneBudget) return;
+
+    QList<QPair<int, QString> > order;
+    for (QHash<QString, Scene>::const_iterator it = scenes.constBegin(); it != scenes.constEnd(); ++it)
+        order.append(qMakePair(it->lastUse, it.key()));
+    qSort(order.begin(), order.end(), byLastUse);
+
+    for (int i = 0; i < order.count() && sceneBytes > sceneBudget; ++i)
+    {
+        const Scene & scene = scenes[order[i].second];
+        sceneBytes -= scene.bytes;
+        deleteScene(scene);
+        scenes.remove(order[i].second);
+    }
+}
+
+static const float highlightEmission[4] = {0.5, 0.5, 0.0, 1.0};
+static const float noEmission[4] = {0.0, 0.0, 0.0, 1.0};
+
+static inline int bondFlags(const Bond & bond, const AtomStates * states)
+{
+    return states ? states->flags[bond.indexA] | states->flags[bond.indexB] : 0;
+}
+
+static inline bool lineBond(const Bond & bond, const AtomStates * states)
+{
+    return states && (states->styles[bond.indexA] == asLine || states->styles[bond.indexB] == asLine);
+}
+
+void GLWidget::drawBonds(const Molecule & molecule, const BondInstances & geometry, const AtomStates * states, RenderMode renderMode, int first, int last)
+{
+    last = qMin(last, molecule.bonds.count());
+
+    glColor3f(1,1,1);
+    glBegin(GL_LINES);
+    for (int i = first; i < last; ++i)
+    {
+        const Bond & bond = molecule.bonds.at(i);
+        if (bondFlags(bond, states) & afHidden) continue;
+        if (renderMode != rmGiant && !lineBond(bond, states)) continue;
+
+        for (int k = geometry.start[i]; k < geometry.start[i + 1]; ++k)
+        {
+            const float * m = geometry.matrices.constData() + 16 * k;
+            glVertex3f(m[12], m[13], m[14]);
+            glVertex3f(m[12] + m[8], m[13] + m[9], m[14] + m[10]);
+        }
+    }
+    glEnd();
+
+    if (renderMode == rmGiant)
+        return;
+
+    for (int i = first; i < last; ++i)
+    {
+        const Bond & bond = molecule.bonds.at(i);
+        int flags = bondFlags(bond, states);
+        if ((flags & afHidden) || lineBond(bond, states)) continue;
+
+        GLuint cylinder = cylinders[renderMode][0];
+        if (bond.type == btDouble) cylinder = cylinders[renderMode][1];
+        if (bond.type == btTriple) cylinder = cylinders[renderMode][2];
+
+        if (flags & afHighlight)
+            glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, highlightEmission);
+        for (int k = geometry.start[i]; k < geometry.start[i + 1]; ++k)
+        {
+            glPushMatrix();
+            glMultMatrixf(geometry.matrices.constData() + 16 * k);
+            glCallList(cylinder);
+            glPopMatrix();
+        }
+        if (flags & afHighlight)
+            glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, noEmission);
     }
+}
+
+void GLWidget::smallObject(const Molecule & molecule, const BondInstances & geometry, const AtomStates * states, RenderMode renderMode, int first, int last)
+{
+    // bonds get the default material, not whatever the last atom left behind
+    const float bondAmbient[4] = {0.2, 0.2, 0.2, 1.0};
+    const float bondDiffuse[4] = {0.8, 0.8, 0.8, 1.0};
+    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, bondAmbient);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, bondDiffuse);
+
+    if (first < molecule.bonds.count())
+        drawBonds(molecule, geometry, states, renderMode, first, last);
 
     // draw atoms
-    foreach (Atom atom, molecule.atoms)
+    for (int i = first; i < qMin(last, molecule.atoms.count()); ++i)
     {
+        const Atom & atom = molecule.atoms.at(i);
+        int flags = states ? states->flags[i] : 0;
+        int style = states ? states->styles[i] : asBallStick;
+        QRgb color = states ? states->colors[i] : 0;
+        if ((flags & afHidden) || style == asLine) continue;
+
         glPushMatrix();
 
-        QMap<QString,Element>::const_iterator it = elements.constFind(atom.element);
-        if (it != elements.end())
+        QMap<QString,ElementLists>::const_iterator it = elementLists.constFind(atom.element);
+        if (it != elementLists.end())
         {
-            float normalMat[4] = {it->color.redF(), it->color.greenF(), it->color.blueF(), 1.0};
-            float anaglyphMat[4] = {it->anaColor.redF(), it->anaColor.greenF(), it->anaColor.blueF(), 1.0};
-
-            glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, anaglyph ? anaglyphMat : normalMat);
-            glTranslated(atom.x, atom.y, atom.z);
-            switch (renderMode)
+            if (qAlpha(color))
             {
-            case rmSmall:
-                glutSolidSphere(it->radius * atomSizeScale, 24, 12);
-                break;
-            case rmLarge:
-                glutSolidSphere(it->radius * atomSizeScale * 0.5, 8, 8);
-                break;
-            case rmGiant:
-                glutSolidSphere(it->radius * atomSizeScale * 0.5, 4, 4);
-                break;
+                float mat[4] = {qRed(color) / 255.0f, qGreen(color) / 255.0f, qBlue(color) / 255.0f, 1.0};
+                glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, mat);
             }
+            else
+                glCallList(it->material);
+
+            if (flags & afHighlight)
+                glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, highlightEmission);
+
+            glTranslated(atom.x, atom.y, atom.z);
+            glCallList(style == asStick ? stickSpheres[renderMode] : it->spheres[renderMode]);
+
+            if (flags & afHighlight)
+                glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, noEmission);
         }
         else
         {
@@ -459,6 +1181,87 @@ void GLWidget::smallObject(RenderMode renderMode)
     }
 }
 
+void GLWidget::compileMaterials()
+{
+    for (QMap<QString,Element>::const_iterator it = elements.constBegin(); it != elements.constEnd(); ++it)
+    {
+        ElementLists & lists = elementLists[it.key()];
+        if (!lists.material)
+            lists.material = glGenLists(1);
+
+        QColor color = anaglyph ? it->anaColor : it->color;
+        float mat[4] = {color.redF(), color.greenF(), color.blueF(), 1.0};
+
+        glNewList(lists.material, GL_COMPILE);
+        glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, mat);
+        glEndList();
+    }
+}
+
+void GLWidget::compileSpheres()
+{
+    const double sizes[3] = { 1, 0.5, 0.5 };
+    const int slices[3] = { 24, 8, 4 };
+    const int stacks[3] = { 12, 8, 4 };
+
+    for (QMap<QString,Element>::const_iterator it = elements.constBegin(); it != elements.constEnd(); ++it)
+    {
+        ElementLists & lists = elementLists[it.key()];
+        if (!lists.spheres[0])
+        {
+            lists.spheres[0] = glGenLists(3);
+            lists.spheres[1] = lists.spheres[0] + 1;
+            lists.spheres[2] = lists.spheres[0] + 2;
+        }
+
+        for (int mode = rmSmall; mode <= rmGiant; ++mode)
+        {
+            glNewList(lists.spheres[mode], GL_COMPILE);
+            glutSolidSphere(it->radius * atomSizeScale * sizes[mode], slices[mode], stacks[mode]);
+            glEndList();
+        }
+    }
+
+    // as thick as single bonds
+    if (!stickSpheres[0])
+    {
+        stickSpheres[0] = glGenLists(3);
+        stickSpheres[1] = stickSpheres[0] + 1;
+        stickSpheres[2] = stickSpheres[0] + 2;
+    }
+    for (int mode = rmSmall; mode <= rmGiant; ++mode)
+    {
+        glNewList(stickSpheres[mode], GL_COMPILE);
+        glutSolidSphere(mode == rmSmall ? 0.07 : 0.035, slices[mode], stacks[mode]);
+        glEndList();
+    }
+}
+
+void GLWidget::compileCylinders()
+{
+    static GLUquadric *quad = gluNewQuadric();
+    const double baseRadius[2] = { 0.01, 0.005 };
+    const double radius[3] = { 7, 5, 4 }; // single, double, triple
+
+    if (!cylinders[0][0])
+    {
+        cylinders[0][0] = glGenLists(6);
+        for (int k = 1; k < 6; ++k)
+            cylinders[k / 3][k % 3] = cylinders[0][0] + k;
+    }
+
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        for (int type = 0; type < 3; ++type)
+        {
+            double r = radius[type] * baseRadius[mode];
+            glNewList(cylinders[mode][type], GL_COMPILE);
+            gluCylinder(quad, r, r, 1, 12, 4);
+            glEndList();
+        }
+    }
+}
+
 void GLWidget::largeObject()
 {
     // draw bonds
@@ -515,15 +1318,163 @@ void GLWidget::giantObject()
     glEnd();
 }
 
+void GLWidget::compileChunk(int chunk)
+{
+    if (!chunks[chunk])
+        chunks[chunk] = glGenLists(1);
+
+    glNewList(chunks[chunk], GL_COMPILE);
+    smallObject(molecule, bondGeometry, &atomStates, renderMode, chunk * chunkSize, (chunk + 1) * chunkSize);
+    glEndList();
+}
+
+void GLWidget::rebuildAdjacency()
+{
+    int atomCount = molecule.atoms.count();
+    atomBondStart.fill(0, atomCount + 1);
+    foreach (const Bond & bond, molecule.bonds)
+    {
+        ++atomBondStart[bond.indexA + 1];
+        ++atomBondStart[bond.indexB + 1];
+    }
+    for (int i = 0; i < atomCount; ++i)
+        atomBondStart[i + 1] += atomBondStart[i];
+
+    QVector<int> fill = atomBondStart;
+    atomBonds.resize(atomBondStart[atomCount]);
+    for (int i = 0; i < molecule.bonds.count(); ++i)
+    {
+        const Bond & bond = molecule.bonds.at(i);
+        atomBonds[fill[bond.indexA]++] = i;
+        atomBonds[fill[bond.indexB]++] = i;
+    }
+}
+
 void GLWidget::recacheObject()
 {
     if (object)
-        glDeleteLists(object, 1);
+        deleteLists();
+
+    bondInstances(molecule.bonds, doubleBondSpacing, tripleBondSpacing, bondGeometry);
+
+    int atomCount = molecule.atoms.count();
+    if (atomStates.flags.count() != atomCount)
+    {
+        atomStates.flags.fill(0, atomCount);
+        atomStates.styles.fill(asBallStick, atomCount);
+        atomStates.colors.fill(0, atomCount);
+    }
+
+    int count = qMax(molecule.atoms.count(), molecule.bonds.count());
+    chunks.fill(0, (count + chunkSize - 1) / chunkSize);
+    for (int i = 0; i < chunks.count(); ++i)
+        compileChunk(i);
 
+    // chunk lists are resolved when the object is called,
+    // so recompiling a chunk leaves this list valid
     object = glGenLists(1);
     glNewList(object, GL_COMPILE);
-    smallObject(renderMode);
+    foreach (GLuint list, chunks)
+        glCallList(list);
     glEndList();
+
+    rebuildAdjacency();
+}
+
+void GLWidget::patchMolecule(const Molecule & molecule, const QVector<int> & changedAtoms, const QVector<int> & changedBonds)
+{
+    this->molecule = molecule;
+    if (!changedBonds.isEmpty())
+        rebuildAdjacency();
+
+    // only the frames of the bonds that changed or whose atoms moved
+    QVector<int> bonds = changedBonds;
+    foreach (int i, changedAtoms)
+        for (int k = atomBondStart[i]; k < atomBondStart[i + 1]; ++k)
+            bonds.append(atomBonds[k]);
+    qSort(bonds);
+    bonds.erase(std::unique(bonds.begin(), bonds.end()), bonds.end());
+    updateBondInstances(this->molecule.bonds, bonds, doubleBondSpacing, tripleBondSpacing, bondGeometry);
+
+    compileChunksOf(changedAtoms, changedBonds);
+}
+
+void GLWidget::compileChunksOf(const QVector<int> & atoms, const QVector<int> & bonds)
+{
+    QSet<int> dirty;
+    foreach (int i, atoms)
+    {
+        dirty.insert(i / chunkSize);
+        for (int k = atomBondStart[i]; k < atomBondStart[i + 1]; ++k)
+            dirty.insert(atomBonds[k] / chunkSize);
+    }
+    foreach (int i, bonds)
+        dirty.insert(i / chunkSize);
+
+    if (dirty.isEmpty()) return;
+
+    makeCurrent();
+    foreach (int chunk, dirty)
+        compileChunk(chunk);
+
+    update();
+}
+
+void GLWidget::setAtomFlag(const QVector<int> & atoms, AtomFlag flag, bool on)
+{
+    QVector<int> changed;
+    foreach (int i, atoms)
+    {
+        quint8 flags = on ? (atomStates.flags[i] | flag) : (atomStates.flags[i] & ~flag);
+        if (flags == atomStates.flags[i]) continue;
+
+        atomStates.flags[i] = flags;
+        changed.append(i);
+    }
+    compileChunksOf(changed, QVector<int>());
+}
+
+void GLWidget::setAtomsVisible(const QVector<int> & atoms, bool visible)
+{
+    setAtomFlag(atoms, afHidden, !visible);
+}
+
+void GLWidget::setAtomsHighlighted(const QVector<int> & atoms, bool highlighted)
+{
+    setAtomFlag(atoms, afHighlight, highlighted);
+}
+
+void GLWidget::setAtomsStyle(const QVector<int> & atoms, AtomStyle style)
+{
+    QVector<int> changed;
+    foreach (int i, atoms)
+    {
+        if (atomStates.styles[i] == style) continue;
+
+        atomStates.styles[i] = style;
+        changed.append(i);
+    }
+    compileChunksOf(changed, QVector<int>());
+}
+
+void GLWidget::setAtomsColor(const QVector<int> & atoms, const QColor & color)
+{
+    QRgb rgb = color.isValid() ? color.rgb() : 0;
+
+    QVector<int> changed;
+    foreach (int i, atoms)
+    {
+        if (atomStates.colors[i] == rgb) continue;
+
+        atomStates.colors[i] = rgb;
+        changed.append(i);
+    }
+    compileChunksOf(changed, QVector<int>());
+}
+
+const AtomStates & GLWidget::getAtomStates()
+{
+    return atomStates;
 }
 
 void GLWidget::resizeGL(int width, int height)
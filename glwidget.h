@@ -4,8 +4,14 @@
 #include <QGLWidget>
 #include <QtOpenGL>
 #include <QMap>
+#include <QHash>
 
 #include "molecule.h"
+#include "bondframes.h"
+
+class BrickStore;
+class BrickCache;
+struct GpuTimer;
 
 enum RenderMode
 {
@@ -14,6 +20,77 @@ enum RenderMode
     rmGiant
 };
 
+enum StereoMode
+{
+    smTwoPass,
+    smReprojected // one render, eyes warped by depth
+};
+
+enum AtomStyle
+{
+    asBallStick,
+    asStick,
+    asLine
+};
+
+enum AtomFlag
+{
+    afHidden = 1,
+    afHighlight = 2
+};
+
+// Display state of each atom, indexed like Molecule::atoms. A bond is
+// hidden, highlighted or drawn as a line if either of its atoms is.
+struct AtomStates
+{
+    QVector<quint8> flags;  // AtomFlag
+    QVector<quint8> styles; // AtomStyle
+    QVector<QRgb> colors;   // overrides the element color unless 0
+};
+
+// Display lists shared by all atoms of an element
+struct ElementLists
+{
+    GLuint material;
+    GLuint spheres[3]; // per render mode
+
+    ElementLists() : material(0) { spheres[0] = spheres[1] = spheres[2] = 0; }
+};
+
+// Display lists and derived data of a molecule that is not shown
+struct Scene
+{
+    Molecule molecule;
+    GLuint object;
+    QVector<GLuint> chunks;
+    BondInstances bondGeometry;
+    AtomStates atomStates;
+    QVector<int> atomBondStart, atomBonds;
+    RenderMode renderMode;
+    qint64 bytes;
+    int lastUse;
+};
+
+// Everything about the view that a camera path records
+struct CameraState
+{
+    double xRot, yRot, zRot;
+    double scale;
+    double panX, panY, panZ;
+    int eyeDistance;
+    int moleculeSize; // as in setMoleculeSize()
+    bool anaglyph;
+
+    bool operator==(const CameraState & other) const;
+};
+
+struct FrameTiming
+{
+    double cpuMs;   // issuing the GL calls
+    double gpuMs;   // from a timer query, negative if not supported
+    double totalMs; // until the GPU is done
+};
+
 enum MousingMode
 {
     mmNone,
@@ -35,6 +112,13 @@ class GLWidget : public QGLWidget
 Q_OBJECT
 
     GLuint object;
+    QVector<GLuint> chunks;
+    QVector<int> atomBondStart, atomBonds;
+    BondInstances bondGeometry;
+    AtomStates atomStates;
+    QMap<QString, ElementLists> elementLists;
+    GLuint stickSpheres[3];
+    GLuint cylinders[2][3]; // small and large mode; single, double, triple
     double xRot, yRot, zRot;
     int eyeDistance;
     double atomSizeScale;
@@ -48,21 +132,104 @@ Q_OBJECT
     double panX, panY, panZ;
     MousingMode mousingMode;
     QPoint panMousePos;
+    QGLFramebufferObject * frameBuffer;
+    StereoMode stereoMode;
+    QGLShaderProgram * reprojection;
+    bool reprojectionFailed;
+    GLuint colorTexture, depthTexture;
+    QSize textureSize;
+    GpuTimer * gpuTimer; // of the current context
+    bool glReady;
+    QTimer * morphTimer;
+    QTime morphClock;
+    QVector<double> morphFrom, morphTarget;
+    QHash<QString, Scene> scenes;
+    QString sceneKey;
+    qint64 sceneBudget, sceneBytes;
+    int sceneClock;
+    BrickStore * bricks;
+    BrickCache * brickCache;
+    qint64 brickBudget;
+    int bricksCompiled; // this frame, by both eyes together
 
     void renderImage();
+    void drawBricks();
+    bool prepareReprojection();
+    void reprojectAnaglyph(double zShift);
 
-    void smallObject(RenderMode renderMode);
+    void smallObject(const Molecule & molecule, const BondInstances & geometry, const AtomStates * states, RenderMode renderMode, int first, int last);
+    void drawBonds(const Molecule & molecule, const BondInstances & geometry, const AtomStates * states, RenderMode renderMode, int first, int last);
     void largeObject();
     void giantObject();
     void recacheObject();
+    void compileChunk(int chunk);
+    void compileChunksOf(const QVector<int> & atoms, const QVector<int> & bonds);
+    void compileMaterials();
+    void compileSpheres();
+    void compileCylinders();
+    void setAtomFlag(const QVector<int> & atoms, AtomFlag flag, bool on);
+    void stashScene();
+    void finishMorph();
+    void morphTo(double t);
+    void trimScenes();
+    void deleteScene(const Scene & scene);
+    void deleteLists();
+    void rebuildAdjacency();
 public:
     explicit GLWidget(QWidget *parent = 0);
     virtual ~GLWidget();
 
-    void setMolecule(const Molecule & molecule);
+    // Compiles and shows the molecule. The display lists of the molecule
+    // shown so far are kept under its key, if it has one; least recently
+    // shown molecules are dropped to fit the budget. Lists kept under the
+    // new key are dropped, as they were built from an older molecule.
+    void setMolecule(const Molecule & molecule, const QString & key = QString());
+    void setSceneBudget(int megabytes);
+
+    // shows the molecule kept under the key again as it was left, without
+    // recompiling; false if nothing is kept under it
+    bool showScene(const QString & key);
+
+    // recompiles only the chunks that contain the given atoms and bonds
+    // (or bonds of the given atoms); the view is left as it is
+    void patchMolecule(const Molecule & molecule, const QVector<int> & changedAtoms, const QVector<int> & changedBonds);
     const Molecule & getMolecule();
     const QMap<QString, Element> & elementMap();
 
+    // Per-atom display state; only the chunks holding the changed atoms
+    // and their bonds are recompiled. Loading a molecule resets it.
+    void setAtomsVisible(const QVector<int> & atoms, bool visible);
+    void setAtomsHighlighted(const QVector<int> & atoms, bool highlighted);
+    void setAtomsStyle(const QVector<int> & atoms, AtomStyle style);
+    // an invalid color goes back to the element color
+    void setAtomsColor(const QVector<int> & atoms, const QColor & color);
+    const AtomStates & getAtomStates();
+
+    // moves the atoms to the given coordinates (x, y, z per atom) in a short animation
+    void animateTo(const QVector<double> & coords);
+
+    // renders the current view offscreen, without showing the widget
+    QImage renderFrame(int width, int height);
+
+    CameraState cameraState();
+    void setCameraState(const CameraState & state);
+
+    // renders the current view at once, timing it, and shows it
+    FrameTiming profileFrame();
+
+    // how anaglyph images are made; falls back to two passes where
+    // shaders are not available
+    void setStereoMode(StereoMode mode);
+    StereoMode getStereoMode();
+
+    // shows a brick store instead of the molecule, loading only the bricks
+    // in view at a level of detail that suits their size on screen;
+    // takes ownership, 0 goes back to the molecule
+    void setBrickStore(BrickStore * store);
+
+    // memory for resident bricks and their display lists
+    void setBrickBudget(int megabytes);
+
 protected:
      virtual void initializeGL();
      virtual void paintGL();
@@ -77,6 +244,7 @@ signals:
      void yRotChanged(int value);
      void zRotChanged(int value);
      void scaleChanged(int value);
+     void frameDrawn();
 
 public slots:
      void setXRot(int value);
@@ -91,6 +259,9 @@ public slots:
 
      // default = 100
      void setEyeDistance(int value);
+
+private slots:
+     void morphStep();
 };
 
 #endif // GLWIDGET_H
@@ -1,12 +1,89 @@
 #include <QtGui/QApplication>
 #include "mainwindow.h"
+#include "glwidget.h"
+#include "renderserver.h"
+#include "camerapath.h"
 #include <GL/glut.h>
+#include <iostream>
 
 int main(int argc, char *argv[])
 {
     glutInit(&argc, argv);
     QApplication a(argc, argv);
+
+    // qanachem --serve tcp:<port> | unix:<name>
+    int serve = a.arguments().indexOf("--serve");
+    if (serve >= 0)
+    {
+        QString address = a.arguments().value(serve + 1);
+
+        GLWidget display;
+        RenderServer server(&display);
+
+        // qanachem --serve ... --cache-budget <MB>
+        int cache = a.arguments().indexOf("--cache-budget");
+        if (cache >= 0)
+            server.setCacheBudget(a.arguments().value(cache + 1).toInt());
+
+        if (!server.listen(address))
+        {
+            std::cerr << "Unable to listen on " << address.toLocal8Bit().data() << std::endl;
+            return 1;
+        }
+
+        return a.exec();
+    }
+
     MainWindow w;
+
+    // qanachem --brick-budget <MB>
+    int budget = a.arguments().indexOf("--brick-budget");
+    if (budget >= 0)
+        w.setBrickBudget(a.arguments().value(budget + 1).toInt());
+
+    // qanachem --cache-budget <MB>
+    int cache = a.arguments().indexOf("--cache-budget");
+    if (cache >= 0)
+        w.setCacheBudget(a.arguments().value(cache + 1).toInt());
+
     w.show();
+
+    // qanachem --open <file>
+    int open = a.arguments().indexOf("--open");
+    if (open >= 0)
+        w.openFile(a.arguments().value(open + 1));
+
+    // anaglyph from one render of the scene, warped per eye by depth
+    if (a.arguments().contains("--reprojected-anaglyph"))
+        w.setReprojectedAnaglyph(true);
+
+    // qanachem --record <path>
+    int record = a.arguments().indexOf("--record");
+    if (record >= 0 && !w.startRecording(a.arguments().value(record + 1)))
+    {
+        std::cerr << "Unable to write " << a.arguments().value(record + 1).toLocal8Bit().data() << std::endl;
+        return 1;
+    }
+
+    // qanachem --replay <path>|spin [--replay-log <csv>]
+    int replay = a.arguments().indexOf("--replay");
+    if (replay >= 0)
+    {
+        a.processEvents();
+
+        ReplayReport report;
+        if (!w.replay(a.arguments().value(replay + 1), report))
+        {
+            std::cerr << "Unable to read " << a.arguments().value(replay + 1).toLocal8Bit().data() << std::endl;
+            return 1;
+        }
+        std::cout << report.summary().toLocal8Bit().data();
+
+        int log = a.arguments().indexOf("--replay-log");
+        if (log >= 0)
+            report.writeLog(a.arguments().value(log + 1));
+        return 0;
+    }
+
     return a.exec();
 }
@@ -2,6 +2,15 @@
 #include "ui_mainwindow.h"
 
 #include <QFileDialog>
+#include <QInputDialog>
+#include <QDir>
+#include <QtConcurrentRun>
+#include <cmath>
+#include "embed.h"
+#include "brickstore.h"
+#include "moleculecache.h"
+#include "decompress.h"
+#include "camerapath.h"
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
@@ -14,6 +23,27 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(timer, SIGNAL(timeout()), this, SLOT(tick()));
     timer->start(50);
 
+    // writers usually touch the file several times in a row
+    watcher = new QFileSystemWatcher(this);
+    reloadTimer = new QTimer(this);
+    reloadTimer->setSingleShot(true);
+    reloadTimer->setInterval(100);
+    connect(watcher, SIGNAL(fileChanged(QString)), this, SLOT(fileChanged()));
+    connect(reloadTimer, SIGNAL(timeout()), this, SLOT(reloadFile()));
+
+    embedWatcher = new QFutureWatcher<QVector<double> >(this);
+    embedGeneration = loadGeneration = 0;
+    embedded = false;
+    connect(embedWatcher, SIGNAL(finished()), this, SLOT(embedFinished()));
+
+    moleculeCache = new MoleculeCache(qint64(256) << 20, this);
+    connect(ui->menuRecent, SIGNAL(triggered(QAction*)), this, SLOT(openRecent(QAction*)));
+
+    recorder = new CameraRecorder(ui->display, this);
+
+    brickWatcher = new QFutureWatcher<bool>(this);
+    connect(brickWatcher, SIGNAL(finished()), this, SLOT(bricksBuilt()));
+
     updateColorMap();
 }
 
@@ -70,12 +100,37 @@ MainWindow::~MainWindow()
 
 void MainWindow::loadFile()
 {
-    QString fname = QFileDialog::getOpenFileName(this, "Load molecule", "molecules/", "MOL/SDF files (*.mol *.sdf);;All files (*)");
+    QString fname = QFileDialog::getOpenFileName(this, "Load molecule", "molecules/", "Molecule files (*.mol *.sdf *.pdb *.ent *.cif *.gz *.zst);;MOL/SDF files (*.mol *.sdf);;PDB/mmCIF files (*.pdb *.ent *.cif);;All files (*)");
     if (fname.isNull()) return;
 
+    openFile(fname);
+}
+
+// the display keeps the lists of recent files under path, size and mtime
+static QString sceneKey(const QString & fname, const QString & stamp)
+{
+    return QFileInfo(fname).canonicalFilePath() + "@" + stamp;
+}
+
+void MainWindow::openFile(const QString & fname)
+{
     try {
-        Molecule mol(fname);
-        ui->display->setMolecule(mol);
+        // taken before parsing, so that a change meanwhile shows as one
+        QString stamp = fileStamp(fname);
+
+        Molecule mol;
+        bool cached = moleculeCache->lookup(fname, mol);
+        if (!cached)
+        {
+            mol = Molecule(fname);
+            moleculeCache->insert(fname, mol, stamp);
+        }
+
+        // a fresh parse is always compiled, whatever the display kept
+        ui->display->setBrickStore(0);
+        if (!cached || !ui->display->showScene(sceneKey(fname, stamp)))
+            ui->display->setMolecule(mol, sceneKey(fname, stamp));
+        embedded = isFlat(mol) && !isFlat(ui->display->getMolecule());
 
         // auto-set render mode
         int mode = 0;
@@ -86,11 +141,427 @@ void MainWindow::loadFile()
 
         ui->comboBox->setCurrentIndex(mode);
         updateColorMap();
+
+        shownChain = QString();
+        applyVisibility();
+
+        if (!currentFile.isEmpty())
+            watcher->removePath(currentFile);
+        currentFile = fname;
+        setWatching(ui->actionWatch_file->isChecked());
+
+        ++loadGeneration;
+        if (ui->actionEmbed_3D->isChecked())
+            embedIfFlat();
+
+        addRecentFile(fname);
+        moleculeCache->prefetch(neighborFile(fname, -1));
+        moleculeCache->prefetch(neighborFile(fname, 1));
     } catch (...) {
         QMessageBox::critical(this, "Load molecule", "Unable to load " + fname + ".");
     }
 }
 
+void MainWindow::addRecentFile(const QString & fname)
+{
+    const int maxRecent = 9;
+
+    QString path = QFileInfo(fname).absoluteFilePath();
+    recentFiles.removeAll(path);
+    recentFiles.prepend(path);
+    while (recentFiles.count() > maxRecent)
+        recentFiles.removeLast();
+
+    ui->menuRecent->clear();
+    for (int i = 0; i < recentFiles.count(); ++i)
+    {
+        QAction * action = ui->menuRecent->addAction(QFileInfo(recentFiles[i]).fileName());
+        action->setData(recentFiles[i]);
+        action->setShortcut(QKeySequence(QString("Ctrl+%1").arg(i + 1)));
+    }
+}
+
+void MainWindow::openRecent(QAction * action)
+{
+    openFile(action->data().toString());
+}
+
+// the file after (step 1) or before (step -1) the given one in its folder
+QString MainWindow::neighborFile(const QString & fname, int step)
+{
+    QFileInfo info(fname);
+    QStringList filters;
+    filters << "*.mol" << "*.sdf" << "*.pdb" << "*.ent" << "*.cif" << "*.gz" << "*.zst";
+    QStringList files = info.dir().entryList(filters, QDir::Files, QDir::Name);
+
+    int i = files.indexOf(info.fileName());
+    if (i < 0 || i + step < 0 || i + step >= files.count())
+        return QString();
+    return info.dir().absoluteFilePath(files[i + step]);
+}
+
+void MainWindow::openNext()
+{
+    QString fname = neighborFile(currentFile, 1);
+    if (!fname.isEmpty())
+        openFile(fname);
+}
+
+void MainWindow::openPrevious()
+{
+    QString fname = neighborFile(currentFile, -1);
+    if (!fname.isEmpty())
+        openFile(fname);
+}
+
+void MainWindow::setCacheBudget(int megabytes)
+{
+    moleculeCache->setBudget(qint64(megabytes) << 20);
+    ui->display->setSceneBudget(megabytes);
+}
+
+void MainWindow::setWatching(bool watching)
+{
+    if (currentFile.isEmpty()) return;
+
+    if (watching)
+        watcher->addPath(currentFile);
+    else
+        watcher->removePath(currentFile);
+}
+
+void MainWindow::fileChanged()
+{
+    reloadTimer->start();
+}
+
+void MainWindow::reloadFile()
+{
+    // files replaced by rename drop out of the watcher
+    if (!watcher->files().contains(currentFile) && QFile::exists(currentFile))
+        watcher->addPath(currentFile);
+
+    // generated coordinates cannot be patched with the file's flat ones,
+    // so those are read again in full and embedded anew
+    Molecule mol = ui->display->getMolecule();
+    QVector<int> atoms, bonds;
+    ReloadResult result = embedded ? rrChanged : mol.reload(currentFile, atoms, bonds);
+    switch (result)
+    {
+    case rrPatched:
+        if (!atoms.isEmpty() || !bonds.isEmpty())
+        {
+            ui->display->patchMolecule(mol, atoms, bonds);
+            ++loadGeneration; // an embedding under way started from the old layout
+        }
+        statusBar()->showMessage(QString("Reloaded %1 atoms, %2 bonds").arg(atoms.count()).arg(bonds.count()), 2000);
+        break;
+
+    case rrChanged:
+        try {
+            // the view state lives in the display, so it survives this
+            QString stamp = fileStamp(currentFile);
+            Molecule mol(currentFile);
+            moleculeCache->insert(currentFile, mol, stamp);
+            ui->display->setMolecule(mol, sceneKey(currentFile, stamp));
+            embedded = false;
+            updateColorMap();
+            applyVisibility();
+            statusBar()->showMessage("Reloaded " + currentFile, 2000);
+
+            ++loadGeneration;
+            if (ui->actionEmbed_3D->isChecked())
+                embedIfFlat();
+        } catch (...) {
+            reloadTimer->start();
+        }
+        break;
+
+    case rrIncomplete:
+        reloadTimer->start();
+        break;
+    }
+}
+
+void MainWindow::setEmbedding(bool embedding)
+{
+    if (embedding)
+        embedIfFlat();
+}
+
+void MainWindow::embedIfFlat()
+{
+    const Molecule & mol = ui->display->getMolecule();
+    if (!isFlat(mol) || embedWatcher->isRunning()) return;
+
+    embedGeneration = loadGeneration;
+    embedWatcher->setFuture(QtConcurrent::run(embed3D, mol));
+    statusBar()->showMessage("Generating 3D coordinates...");
+}
+
+void MainWindow::embedFinished()
+{
+    statusBar()->clearMessage();
+
+    // another file was loaded in the meantime
+    if (embedGeneration != loadGeneration)
+    {
+        if (ui->actionEmbed_3D->isChecked())
+            embedIfFlat();
+        return;
+    }
+
+    ui->display->animateTo(embedWatcher->result());
+    embedded = true;
+}
+
+void MainWindow::setBrickBudget(int megabytes)
+{
+    ui->display->setBrickBudget(megabytes);
+}
+
+void MainWindow::loadLargeFile()
+{
+    if (brickWatcher->isRunning()) return;
+
+    QString fname = QFileDialog::getOpenFileName(this, "Open large structure", "molecules/", "PDB/mmCIF files (*.pdb *.ent *.cif *.gz *.zst);;Brick files (*.bricks);;All files (*)");
+    if (fname.isNull()) return;
+
+    // the converted structure is kept next to the source and reused
+    brickFile = fname.endsWith(".bricks") ? fname : fname + ".bricks";
+    if (brickFile == fname || BrickStore::isCurrent(fname, brickFile))
+    {
+        openBricks();
+        return;
+    }
+
+    brickWatcher->setFuture(QtConcurrent::run(BrickStore::build, fname, brickFile));
+    statusBar()->showMessage("Sorting " + fname + " into bricks...");
+}
+
+void MainWindow::bricksBuilt()
+{
+    statusBar()->clearMessage();
+    if (!brickWatcher->result())
+    {
+        QFile::remove(brickFile);
+        QMessageBox::critical(this, "Open large structure", "Unable to convert the structure to " + brickFile + ".");
+        return;
+    }
+
+    openBricks();
+}
+
+void MainWindow::openBricks()
+{
+    BrickStore * store = new BrickStore;
+    if (!store->open(brickFile))
+    {
+        delete store;
+        QMessageBox::critical(this, "Open large structure", "Unable to open " + brickFile + ".");
+        return;
+    }
+
+    if (!currentFile.isEmpty())
+        watcher->removePath(currentFile);
+    currentFile = QString();
+    ++loadGeneration;
+
+    ui->display->setBrickStore(store);
+    ui->comboBox->setCurrentIndex(0);
+    updateColorMap();
+    statusBar()->showMessage(QString("%1 atoms in %2 bricks").arg(store->atoms()).arg(store->brickCount()), 4000);
+}
+
+void MainWindow::setHidingHydrogens(bool)
+{
+    applyVisibility();
+}
+
+void MainWindow::showChain()
+{
+    QStringList chains;
+    foreach (const Atom & atom, ui->display->getMolecule().atoms)
+    {
+        if (!atom.chain.isEmpty() && !chains.contains(atom.chain))
+            chains.append(atom.chain);
+    }
+    if (chains.isEmpty())
+    {
+        statusBar()->showMessage("The molecule has no chains", 2000);
+        return;
+    }
+
+    chains.prepend("All");
+    bool ok;
+    QString chain = QInputDialog::getItem(this, "Show chain", "Chain:", chains, qMax(0, chains.indexOf(shownChain)), false, &ok);
+    if (!ok) return;
+
+    shownChain = (chain == "All") ? QString() : chain;
+    applyVisibility();
+}
+
+// only atoms whose visibility changes end up recompiled
+void MainWindow::applyVisibility()
+{
+    bool hideHydrogens = ui->actionHide_hydrogens->isChecked();
+
+    QVector<int> shown, hidden;
+    const QList<Atom> & atoms = ui->display->getMolecule().atoms;
+    for (int i = 0; i < atoms.count(); ++i)
+    {
+        const Atom & atom = atoms.at(i);
+        bool visible = !(hideHydrogens && atom.element == "H")
+            && (shownChain.isEmpty() || atom.chain == shownChain);
+        (visible ? shown : hidden).append(i);
+    }
+
+    ui->display->setAtomsVisible(shown, true);
+    ui->display->setAtomsVisible(hidden, false);
+}
+
+bool MainWindow::startRecording(const QString & fname)
+{
+    if (!recorder->start(fname)) return false;
+
+    ui->actionRecord_path->blockSignals(true);
+    ui->actionRecord_path->setChecked(true);
+    ui->actionRecord_path->blockSignals(false);
+    return true;
+}
+
+void MainWindow::setRecording(bool recording)
+{
+    if (!recording)
+    {
+        recorder->stop();
+        statusBar()->clearMessage();
+        return;
+    }
+
+    QString fname = QFileDialog::getSaveFileName(this, "Record camera path", "", "Camera paths (*.path);;All files (*)");
+    if (fname.isNull() || !recorder->start(fname))
+    {
+        ui->actionRecord_path->setChecked(false);
+        return;
+    }
+    statusBar()->showMessage("Recording camera path to " + fname);
+}
+
+bool MainWindow::replay(const QString & fname, ReplayReport & report)
+{
+    QVector<CameraFrame> path;
+    if (fname == "spin")
+        path = spinPath(ui->display->cameraState());
+    else if (!readCameraPath(fname, path))
+        return false;
+
+    report = replayCameraPath(ui->display, path);
+    return true;
+}
+
+void MainWindow::replayPath()
+{
+    QString fname = QFileDialog::getOpenFileName(this, "Replay camera path", "", "Camera paths (*.path);;All files (*)");
+    if (fname.isNull()) return;
+
+    ReplayReport report;
+    if (!replay(fname, report))
+    {
+        QMessageBox::critical(this, "Replay camera path", "Unable to read " + fname + ".");
+        return;
+    }
+    QMessageBox::information(this, "Replay camera path", report.summary());
+}
+
+void MainWindow::setReprojectedAnaglyph(bool reprojected)
+{
+    ui->actionReprojected_anaglyph->setChecked(reprojected);
+    setReprojection(reprojected);
+}
+
+void MainWindow::setReprojection(bool reprojected)
+{
+    ui->display->setStereoMode(reprojected ? smReprojected : smTwoPass);
+}
+
+// peak signal to noise ratio over all channels, in dB
+static double psnr(const QImage & a, const QImage & b)
+{
+    double sum = 0;
+    int n = 0;
+    for (int y = 0; y < qMin(a.height(), b.height()); ++y)
+        for (int x = 0; x < qMin(a.width(), b.width()); ++x)
+        {
+            QRgb p = a.pixel(x, y), q = b.pixel(x, y);
+            int dr = qRed(p) - qRed(q), dg = qGreen(p) - qGreen(q), db = qBlue(p) - qBlue(q);
+            sum += dr*dr + dg*dg + db*db;
+            n += 3;
+        }
+
+    if (n == 0 || sum == 0) return 99;
+    return 10 * log10(255.0 * 255 * n / sum);
+}
+
+static QWidget * comparePane(const QString & title, const QImage & image, const FrameTiming & timing)
+{
+    QWidget * pane = new QWidget();
+    QVBoxLayout * layout = new QVBoxLayout(pane);
+    QLabel * picture = new QLabel();
+    picture->setPixmap(QPixmap::fromImage(image));
+    layout->addWidget(new QLabel(title));
+    layout->addWidget(picture);
+    layout->addWidget(new QLabel(QString("cpu %1 ms, gpu %2, total %3 ms")
+        .arg(timing.cpuMs, 0, 'f', 2)
+        .arg(timing.gpuMs >= 0 ? QString::number(timing.gpuMs, 'f', 2) + " ms" : QString("n/a"))
+        .arg(timing.totalMs, 0, 'f', 2)));
+    return pane;
+}
+
+void MainWindow::compareAnaglyph()
+{
+    const int frames = 10;
+    GLWidget * display = ui->display;
+    CameraState original = display->cameraState();
+    StereoMode originalMode = display->getStereoMode();
+
+    CameraState state = original;
+    state.anaglyph = true;
+    display->setCameraState(state);
+
+    QImage images[2];
+    FrameTiming timings[2];
+    StereoMode modes[2] = { smTwoPass, smReprojected };
+    for (int m = 0; m < 2; ++m)
+    {
+        display->setStereoMode(modes[m]);
+        images[m] = display->renderFrame(display->width(), display->height());
+
+        // the first frame compiles shaders and textures
+        display->profileFrame();
+        FrameTiming & sum = timings[m];
+        sum.cpuMs = sum.gpuMs = sum.totalMs = 0;
+        for (int i = 0; i < frames; ++i)
+        {
+            FrameTiming timing = display->profileFrame();
+            sum.cpuMs += timing.cpuMs / frames;
+            sum.gpuMs = (timing.gpuMs < 0 || sum.gpuMs < 0) ? -1 : sum.gpuMs + timing.gpuMs / frames;
+            sum.totalMs += timing.totalMs / frames;
+        }
+    }
+
+    display->setStereoMode(originalMode);
+    display->setCameraState(original);
+
+    QDialog dialog(this);
+    dialog.setWindowTitle("Compare anaglyph modes");
+    QHBoxLayout * layout = new QHBoxLayout(&dialog);
+    layout->addWidget(comparePane("Two passes", images[0], timings[0]));
+    layout->addWidget(comparePane(QString("Single render, PSNR %1 dB")
+        .arg(psnr(images[0], images[1]), 0, 'f', 1), images[1], timings[1]));
+    dialog.exec();
+}
+
 void MainWindow::changeEvent(QEvent *e)
 {
     QMainWindow::changeEvent(e);
@@ -5,11 +5,17 @@
 #include <QGraphicsScene>
 #include <QtOpenGL>
 #include <QTimer>
+#include <QFileSystemWatcher>
+#include <QFutureWatcher>
 
 namespace Ui {
     class MainWindow;
 }
 
+class MoleculeCache;
+class CameraRecorder;
+struct ReplayReport;
+
 class MainWindow : public QMainWindow {
     Q_OBJECT
 
@@ -17,18 +23,67 @@ public:
     MainWindow(QWidget *parent = 0);
     ~MainWindow();
 
+    // memory for the bricks of large structures, in megabytes
+    void setBrickBudget(int megabytes);
+
+    // memory for recently used molecules, and again for their display lists
+    void setCacheBudget(int megabytes);
+
+    void openFile(const QString & fname);
+
+    bool startRecording(const QString & fname);
+
+    // replays a camera path file, or a full turn for "spin"
+    bool replay(const QString & fname, ReplayReport & report);
+
+    void setReprojectedAnaglyph(bool reprojected);
+
 protected:
     void changeEvent(QEvent *e);
 
 private:
     Ui::MainWindow *ui;
     QTimer * timer;
+    QFileSystemWatcher * watcher;
+    QTimer * reloadTimer;
+    QString currentFile;
+    QFutureWatcher<QVector<double> > * embedWatcher;
+    int embedGeneration, loadGeneration;
+    bool embedded; // the display shows generated, not file, coordinates
+    QFutureWatcher<bool> * brickWatcher;
+    QString brickFile;
+    QString shownChain;
+    MoleculeCache * moleculeCache;
+    QStringList recentFiles;
+    CameraRecorder * recorder;
+
+    void embedIfFlat();
+    void openBricks();
+    void applyVisibility();
+    void addRecentFile(const QString & fname);
+    QString neighborFile(const QString & fname, int step);
 
 public slots:
     virtual void loadFile();
     virtual void tick();
     virtual void saveView();
     virtual void updateColorMap();
+    virtual void setWatching(bool watching);
+    virtual void fileChanged();
+    virtual void reloadFile();
+    virtual void setEmbedding(bool embedding);
+    virtual void embedFinished();
+    virtual void loadLargeFile();
+    virtual void bricksBuilt();
+    virtual void setHidingHydrogens(bool hiding);
+    virtual void showChain();
+    virtual void openRecent(QAction * action);
+    virtual void openNext();
+    virtual void openPrevious();
+    virtual void setRecording(bool recording);
+    virtual void replayPath();
+    virtual void setReprojection(bool reprojected);
+    virtual void compareAnaglyph();
 };
 
 #endif // MAINWINDOW_H
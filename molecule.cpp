@@ -1,17 +1,24 @@
 #include "molecule.h"
+#include "pdb.h"
+#include "decompress.h"
 #include <QFile>
+#include <QFileInfo>
 #include <iostream>
 #include <QStringList>
+#include <QScopedPointer>
 #include <QDebug>
 
 Molecule::Molecule()
 {
     massCenterX = massCenterY = massCenterZ = 0;
+    index.size = 0;
+    index.counts = 0;
 }
 
-QStringList readFields(QFile & f)
+QStringList splitFields(const QByteArray & line)
 {
-    QStringList result = QString(f.readLine()).split(' ', QString::SkipEmptyParts);
+    QStringList result = QString(line).split(' ', QString::SkipEmptyParts);
+    if (result.isEmpty()) return result;
 
     int r0 = result[0].toInt();
     if (r0 > 1000)
@@ -37,29 +44,94 @@ static BondType int2bt(int type)
     }
 }
 
+static void readAtom(Atom & atom, const QStringList & fields)
+{
+    atom.x = fields[0].toDouble();
+    atom.y = fields[1].toDouble();
+    atom.z = fields[2].toDouble();
+    atom.element = fields[3];
+}
+
+static void readBond(Bond & bond, const QStringList & fields, QList<Atom> & atoms)
+{
+    bond.indexA = fields[0].toInt() - 1;
+    bond.indexB = fields[1].toInt() - 1;
+    bond.a = &atoms[bond.indexA];
+    bond.b = &atoms[bond.indexB];
+    bond.type = int2bt(fields[2].toInt());
+}
+
+static void readStructure(Molecule & molecule, QIODevice & f, bool cif)
+{
+    // map the file instead of copying it when possible
+    QFile * file = qobject_cast<QFile *>(&f);
+    qint64 size = file ? file->size() : 0;
+    const char * data = file ? (const char *) file->map(0, size) : 0;
+    QByteArray buffer;
+    if (!data)
+    {
+        buffer = f.readAll();
+        data = buffer.constData();
+        size = buffer.size();
+    }
+
+    if (cif)
+        readCif(molecule, data, size);
+    else
+        readPdb(molecule, data, size);
+}
+
 Molecule::Molecule(const QString &fname)
 {
-    QFile f(fname);
-    f.open(QIODevice::ReadOnly);
-    name = f.readLine();
-    comment = f.readLine();
-    f.readLine();
+    QScopedPointer<QIODevice> dev(openMoleculeFile(fname));
+    if (!dev)
+        throw QString("Unable to open " + fname);
+    QIODevice & f = *dev;
+
+    massCenterX = massCenterY = massCenterZ = 0;
+    index.size = 0;
+    index.counts = 0;
+
+    QString suffix = QFileInfo(uncompressedName(fname)).suffix().toLower();
+    if (suffix == "pdb" || suffix == "ent" || suffix == "cif" || suffix == "mmcif")
+    {
+        readStructure(*this, f, suffix.endsWith("cif"));
 
-    QStringList info = readFields(f);
+        QString error = decompressError(f);
+        if (!error.isEmpty())
+            throw error;
+        return;
+    }
+
+    QByteArray line = f.readLine();
+    name = line;
+    index.size += line.size();
+    line = f.readLine();
+    comment = line;
+    index.size += line.size();
+    index.size += f.readLine().size();
+
+    line = f.readLine();
+    index.size += line.size();
+    index.counts = qHash(line);
+    QStringList info = splitFields(line);
+    if (info.count() < 2)
+        throw QString("Missing counts line in " + fname);
     int atomCnt = info[0].toInt();
     int bondCnt = info[1].toInt();
 
-    massCenterX = massCenterY = massCenterZ = 0;
     for (int i = 0; i < atomCnt; ++i)
     {
-        QStringList fields = readFields(f);
+        line = f.readLine();
+        index.size += line.size();
+        index.atoms.append(qHash(line));
 
-        Atom atom;
-        atom.x = fields[0].toDouble();
-        atom.y = fields[1].toDouble();
-        atom.z = fields[2].toDouble();
-        atom.element = fields[3];
+        QStringList fields = splitFields(line);
+        if (fields.count() < 4)
+            throw QString("Truncated atom block in " + fname);
 
+        Atom atom;
+        readAtom(atom, fields);
         atoms.append(atom);
 
         massCenterX += atom.x;
@@ -72,14 +144,136 @@ Molecule::Molecule(const QString &fname)
 
     for (int i = 0; i < bondCnt; ++i)
     {
-        QStringList fields = readFields(f);
+        line = f.readLine();
+        index.size += line.size();
+        index.bonds.append(qHash(line));
 
-        Bond bond;
-        // qDebug() << i << ": " << fields << endl;
-        bond.a = &atoms[fields[0].toInt() - 1];
-        bond.b = &atoms[fields[1].toInt() - 1];
-        bond.type = int2bt(fields[2].toInt());
+        QStringList fields = splitFields(line);
+        if (fields.count() < 3)
+            throw QString("Truncated bond block in " + fname);
 
+        Bond bond;
+        readBond(bond, fields, atoms);
         bonds.append(bond);
     }
+
+    QString error = decompressError(f);
+    if (!error.isEmpty())
+        throw error;
+}
+
+void Molecule::detach()
+{
+    QList<Atom> copy;
+    copy.reserve(atoms.count());
+    foreach (const Atom & atom, atoms)
+        copy.append(atom);
+    atoms = copy;
+
+    for (int i = 0; i < bonds.count(); ++i)
+    {
+        Bond & bond = bonds[i];
+        bond.a = &atoms[bond.indexA];
+        bond.b = &atoms[bond.indexB];
+    }
+}
+
+static inline bool sameAtom(const Atom & a, const Atom & b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z && a.element == b.element;
+}
+
+ReloadResult Molecule::reload(const QString & fname, QVector<int> & changedAtoms, QVector<int> & changedBonds)
+{
+    if (index.atoms.isEmpty())
+        return rrChanged;
+
+    int atomCnt = index.atoms.count();
+    int bondCnt = index.bonds.count();
+
+    // the record with some slack for longer lines; the rest of the file,
+    // such as further records of an SD file, is not read
+    qint64 length = index.size + index.size / 8 + 4096;
+    QByteArray data = readDecompressedRange(fname, 0, length);
+
+    // line boundaries only; nothing is parsed yet
+    QVector<int> lineStart;
+    lineStart.append(0);
+    int lines = 4 + atomCnt + bondCnt;
+    for (int pos = data.indexOf('\n'); pos >= 0 && lineStart.count() <= lines; pos = data.indexOf('\n', pos + 1))
+        lineStart.append(pos + 1);
+    if (lineStart.count() <= lines && lineStart.last() < data.size() && data.size() < length)
+        lineStart.append(data.size()); // no newline at the end of the file
+    if (lineStart.count() <= lines)
+    {
+        // the record grew past the slack, or the file is being written
+        if (data.size() < length)
+            return rrIncomplete;
+        return rrChanged;
+    }
+    index.size = lineStart[lines];
+
+    #define LINE(i) QByteArray::fromRawData(data.constData() + lineStart[i], lineStart[(i) + 1] - lineStart[i])
+
+    if (qHash(LINE(3)) != index.counts)
+    {
+        QStringList info = splitFields(LINE(3));
+        if (info.count() < 2 || info[0].toInt() != atomCnt || info[1].toInt() != bondCnt)
+            return rrChanged;
+    }
+
+    changedAtoms.clear();
+    changedBonds.clear();
+
+    bool detached = false;
+    for (int i = 0; i < atomCnt; ++i)
+    {
+        QByteArray line = LINE(4 + i);
+        uint hash = qHash(line);
+        if (hash == index.atoms[i]) continue;
+
+        QStringList fields = splitFields(line);
+        if (fields.count() < 4) return rrIncomplete;
+
+        Atom atom = atoms.at(i);
+        readAtom(atom, fields);
+        index.atoms[i] = hash;
+        if (sameAtom(atom, atoms.at(i))) continue;
+
+        if (!detached)
+        {
+            detach();
+            detached = true;
+        }
+
+        atoms[i] = atom;
+        changedAtoms.append(i);
+    }
+
+    for (int i = 0; i < bondCnt; ++i)
+    {
+        QByteArray line = LINE(4 + atomCnt + i);
+        uint hash = qHash(line);
+        if (hash == index.bonds[i]) continue;
+
+        QStringList fields = splitFields(line);
+        if (fields.count() < 3) return rrIncomplete;
+        if (fields[0].toInt() < 1 || fields[0].toInt() > atomCnt
+                || fields[1].toInt() < 1 || fields[1].toInt() > atomCnt)
+            return rrChanged;
+
+        if (!detached)
+        {
+            detach();
+            detached = true;
+        }
+
+        readBond(bonds[i], fields, atoms);
+        index.bonds[i] = hash;
+        changedBonds.append(i);
+    }
+
+    #undef LINE
+
+    return rrPatched;
 }
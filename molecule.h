@@ -3,6 +3,7 @@
 
 #include <QString>
 #include <QList>
+#include <QVector>
 
 enum BondType
 {
@@ -17,14 +18,39 @@ struct Atom
 {
     double x, y, z;
     QString element;
+
+    // biomolecular metadata (PDB/mmCIF only)
+    QString name;
+    QString residue;
+    QString chain;
+    int residueSeq;
+
+    Atom() : x(0), y(0), z(0), residueSeq(0) {}
 };
 
 struct Bond
 {
     Atom *a, *b;
+    int indexA, indexB; // of a and b in Molecule::atoms
     BondType type;
 };
 
+enum ReloadResult
+{
+    rrPatched,
+    rrChanged,   // layout differs, needs a full reload
+    rrIncomplete // the file is being written
+};
+
+// Line hashes of an MDL record, to tell which lines changed on reload
+struct RecordIndex
+{
+    qint64 size; // bytes from the start of the file to the end of the bonds
+    uint counts;
+    QVector<uint> atoms;
+    QVector<uint> bonds;
+};
+
 struct Molecule
 {
     QString name;
@@ -34,8 +60,19 @@ struct Molecule
 
     double massCenterX, massCenterY, massCenterZ;
 
+    RecordIndex index;
+
     Molecule();
     Molecule(const QString & fname);
+
+    // deep copy of the atoms, with the bonds pointing into it
+    void detach();
+
+    // re-parses only the atom and bond lines that changed since the file
+    // was read; the mass center is kept so that the view does not move.
+    // Only the record is read back, not the rest of the file, but all of
+    // its lines are hashed.
+    ReloadResult reload(const QString & fname, QVector<int> & changedAtoms, QVector<int> & changedBonds);
 };
 
 #endif // MOLECULE_H
@@ -0,0 +1,160 @@
+#include "moleculecache.h"
+#include "decompress.h"
+#include <QFileInfo>
+#include <QtConcurrentRun>
+#include <QtAlgorithms>
+
+static QString cacheKey(const QString & fname)
+{
+    return QFileInfo(fname).canonicalFilePath();
+}
+
+static qint64 moleculeBytes(const Molecule & molecule)
+{
+    return molecule.atoms.count() * (sizeof(Atom) + 64)
+        + molecule.bonds.count() * (sizeof(Bond) + 16);
+}
+
+// whether stamp a is of an earlier modification than stamp b
+static bool olderStamp(const QString & a, const QString & b)
+{
+    QString ta = a.section(':', 1), tb = b.section(':', 1);
+    qint64 sa = ta.section('.', 0, 0).toLongLong(), sb = tb.section('.', 0, 0).toLongLong();
+    if (sa != sb) return sa < sb;
+    return ta.section('.', 1).toLongLong() < tb.section('.', 1).toLongLong();
+}
+
+// runs on the thread pool; files that do not parse come back empty
+static Molecule loadMolecule(const QString & fname)
+{
+    try {
+        return Molecule(fname);
+    } catch (...) {
+        return Molecule();
+    }
+}
+
+MoleculeCache::MoleculeCache(qint64 budget, QObject * parent)
+    : QObject(parent)
+{
+    this->budget = budget;
+    used = 0;
+    clock = 0;
+}
+
+MoleculeCache::~MoleculeCache()
+{
+    foreach (QFutureWatcher<Molecule> * watcher, loading)
+    {
+        watcher->disconnect(this);
+        watcher->waitForFinished();
+    }
+}
+
+void MoleculeCache::setBudget(qint64 bytes)
+{
+    budget = bytes;
+    trim();
+}
+
+bool MoleculeCache::lookup(const QString & fname, Molecule & molecule)
+{
+    QString key = cacheKey(fname);
+    QHash<QString, Entry>::iterator it = entries.find(key);
+    if (it == entries.end()) return false;
+
+    if (it->stamp != fileStamp(fname))
+    {
+        used -= it->bytes;
+        entries.erase(it);
+        return false;
+    }
+
+    it->lastUse = ++clock;
+    molecule = it->molecule;
+    return true;
+}
+
+void MoleculeCache::insert(const QString & fname, const Molecule & molecule, const QString & stamp)
+{
+    store(fname, molecule, stamp, ++clock);
+}
+
+void MoleculeCache::store(const QString & fname, const Molecule & molecule, const QString & stamp, int lastUse)
+{
+    QString key = cacheKey(fname);
+    if (key.isEmpty()) return;
+
+    if (entries.contains(key))
+        used -= entries[key].bytes;
+
+    Entry entry;
+    entry.molecule = molecule;
+    entry.stamp = stamp;
+    entry.bytes = moleculeBytes(molecule);
+    entry.lastUse = lastUse;
+
+    entries.insert(key, entry);
+    used += entry.bytes;
+    trim();
+}
+
+void MoleculeCache::prefetch(const QString & fname)
+{
+    QString key = cacheKey(fname);
+    if (key.isEmpty() || loading.contains(key)) return;
+
+    QHash<QString, Entry>::const_iterator it = entries.constFind(key);
+    QString stamp = fileStamp(key);
+    if (it != entries.constEnd() && it->stamp == stamp)
+        return;
+
+    QFutureWatcher<Molecule> * watcher = new QFutureWatcher<Molecule>(this);
+    connect(watcher, SIGNAL(finished()), this, SLOT(prefetched()));
+    watcher->setFuture(QtConcurrent::run(loadMolecule, key));
+    loading.insert(key, watcher);
+    loadingStamps.insert(key, stamp);
+}
+
+void MoleculeCache::prefetched()
+{
+    QFutureWatcher<Molecule> * watcher = static_cast<QFutureWatcher<Molecule> *>(sender());
+    QString key = loading.key(watcher);
+    loading.remove(key);
+    QString stamp = loadingStamps.take(key);
+
+    Molecule molecule = watcher->result();
+
+    // a parse stored while this one ran stays, with its place in the
+    // order, unless it is of an older version of the file
+    QHash<QString, Entry>::const_iterator it = entries.constFind(key);
+    bool newer = (it == entries.constEnd() || olderStamp(it->stamp, stamp));
+
+    // prefetched files are the first to go
+    if (!molecule.atoms.isEmpty() && newer)
+        store(key, molecule, stamp, 0);
+
+    watcher->deleteLater();
+}
+
+static bool byLastUse(const QPair<int, QString> & a, const QPair<int, QString> & b)
+{
+    return a.first < b.first;
+}
+
+// the most recently used entry stays, whatever its size
+void MoleculeCache::trim()
+{
+    if (used <= budget) return;
+
+    QList<QPair<int, QString> > order;
+    for (QHash<QString, Entry>::const_iterator it = entries.constBegin(); it != entries.constEnd(); ++it)
+        order.append(qMakePair(it->lastUse, it.key()));
+    qSort(order.begin(), order.end(), byLastUse);
+
+    for (int i = 0; i + 1 < order.count() && used > budget; ++i)
+    {
+        used -= entries[order[i].second].bytes;
+        entries.remove(order[i].second);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef MOLECULECACHE_H
+#define MOLECULECACHE_H
+
+#include <QObject>
+#include <QHash>
+#include <QFutureWatcher>
+
+#include "molecule.h"
+
+// Recently used molecules by path. An entry is dropped when its file is
+// modified or the least recently used ones no longer fit the budget.
+// Files can be parsed ahead of use on the thread pool.
+class MoleculeCache : public QObject
+{
+Q_OBJECT
+
+    struct Entry
+    {
+        Molecule molecule;
+        QString stamp; // as in fileStamp()
+        qint64 bytes;
+        int lastUse;
+    };
+
+    QHash<QString, Entry> entries;
+    QHash<QString, QFutureWatcher<Molecule> *> loading;
+    QHash<QString, QString> loadingStamps; // taken before parsing
+    qint64 budget, used;
+    int clock;
+
+    void store(const QString & fname, const Molecule & molecule, const QString & stamp, int lastUse);
+    void trim();
+
+public:
+    MoleculeCache(qint64 budget, QObject * parent = 0);
+    virtual ~MoleculeCache();
+
+    void setBudget(qint64 bytes);
+
+    // false if the file is not cached or changed since
+    bool lookup(const QString & fname, Molecule & molecule);
+    // the stamp is the file's as taken before it was parsed
+    void insert(const QString & fname, const Molecule & molecule, const QString & stamp);
+
+    // parses the file in the background unless it is cached already
+    void prefetch(const QString & fname);
+
+private slots:
+    void prefetched();
+};
+
+#endif // MOLECULECACHE_H
@@ -0,0 +1,967 @@
+#include "pdb.h"
+#include <QtConcurrentMap>
+#include <QThread>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QVarLengthArray>
+#include <QStringList>
+#include <string.h>
+#include <ctype.h>
+
+struct ParseChunk
+{
+    const char * begin;
+    const char * end;
+
+    QVector<Atom> atoms;
+    QVector<int> serials;
+    QVector<QPair<int, int> > links; // CONECT, by serial number
+
+    // number of atoms parsed before the end of the first model (or the end
+    // of the atom_site loop); -1 if the chunk does not contain it
+    int stopAt;
+
+    ParseChunk() : begin(0), end(0), stopAt(-1) {}
+};
+
+struct CifColumns
+{
+    int count;
+    int x, y, z;
+    int element, name, residue, chain, residueSeq, altLoc, model;
+    QByteArray firstModel;
+};
+
+struct BondRec
+{
+    int a, b;
+    BondType type;
+};
+
+struct BondTask
+{
+    const QList<Atom> * atoms;
+    const QVector<int> * residueStart;
+    int first, last; // residue range
+    QVector<BondRec> bonds;
+};
+
+struct TemplateBond
+{
+    QString a, b;
+    BondType type;
+};
+
+typedef QHash<QString, QVector<TemplateBond> > TemplateMap;
+
+static inline void trim(const char *& b, const char *& e)
+{
+    while (b < e && isspace((uchar) *b)) ++b;
+    while (e > b && isspace((uchar) e[-1])) --e;
+}
+
+static inline int parseInt(const char * b, const char * e)
+{
+    trim(b, e);
+
+    bool neg = false;
+    if (b < e && (*b == '-' || *b == '+'))
+        neg = (*b++ == '-');
+
+    int value = 0;
+    while (b < e && isdigit((uchar) *b))
+        value = 10 * value + (*b++ - '0');
+
+    return neg ? -value : value;
+}
+
+// Atom serial of five columns; past 99999 it is written in hybrid-36
+// (A0000..ZZZZZ, then a0000..zzzzz). Returns -1 for what is neither.
+static int parseSerial(const char * b, const char * e)
+{
+    trim(b, e);
+    if (b == e) return -1;
+    if (isdigit((uchar) *b) || *b == '-') return parseInt(b, e);
+
+    bool upper = isupper((uchar) *b);
+    qint64 value = 0;
+    for (; b < e; ++b)
+    {
+        int digit;
+        if (isdigit((uchar) *b)) digit = *b - '0';
+        else if (upper && isupper((uchar) *b)) digit = *b - 'A' + 10;
+        else if (!upper && islower((uchar) *b)) digit = *b - 'a' + 10;
+        else return -1;
+        value = 36 * value + digit;
+    }
+
+    const qint64 block = 36 * 36 * 36 * 36;
+    return int(value - 10 * block + 100000 + (upper ? 0 : 26 * block));
+}
+
+static inline double parseReal(const char * b, const char * e)
+{
+    static const double pow10[] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+
+    trim(b, e);
+
+    bool neg = false;
+    if (b < e && (*b == '-' || *b == '+'))
+        neg = (*b++ == '-');
+
+    double value = 0;
+    while (b < e && isdigit((uchar) *b))
+        value = 10 * value + (*b++ - '0');
+
+    if (b < e && *b == '.')
+    {
+        ++b;
+        qint64 frac = 0;
+        int digits = 0;
+        while (b < e && isdigit((uchar) *b))
+        {
+            if (digits < 9)
+            {
+                frac = 10 * frac + (*b - '0');
+                ++digits;
+            }
+            ++b;
+        }
+        value += frac / pow10[digits];
+    }
+
+    if (b < e && (*b == 'e' || *b == 'E'))
+    {
+        int exp = parseInt(b + 1, e);
+        while (exp > 0) { value *= 10; --exp; }
+        while (exp < 0) { value /= 10; ++exp; }
+    }
+
+    return neg ? -value : value;
+}
+
+// Most names are at most four characters long, so they are shared through
+// a table keyed by their packed bytes instead of allocating a QString each.
+class Interner
+{
+    QHash<quint32, QString> table;
+
+public:
+    QString get(const char * b, const char * e)
+    {
+        trim(b, e);
+        int len = e - b;
+        if (len > 4)
+            return QString::fromLatin1(b, len);
+
+        quint32 key = 0;
+        for (const char * p = b; p < e; ++p)
+            key = (key << 8) | (uchar) *p;
+
+        QHash<quint32, QString>::const_iterator it = table.constFind(key);
+        if (it != table.constEnd())
+            return *it;
+
+        QString s = QString::fromLatin1(b, len);
+        table.insert(key, s);
+        return s;
+    }
+
+    // "FE" -> "Fe", as used by the element map
+    QString element(const char * b, const char * e)
+    {
+        trim(b, e);
+
+        char buf[2];
+        int len = 0;
+        for (; b < e && len < 2; ++b)
+        {
+            if (!isalpha((uchar) *b)) continue;
+            buf[len] = len ? tolower(*b) : toupper(*b);
+            ++len;
+        }
+
+        return get(buf, buf + len);
+    }
+};
+
+static QVector<ParseChunk> splitLines(const char * data, const char * end)
+{
+    qint64 size = end - data;
+    int count = (size < (1 << 20)) ? 1 : QThread::idealThreadCount() * 4;
+
+    QVector<ParseChunk> chunks;
+    const char * p = data;
+    for (int i = 0; i < count && p < end; ++i)
+    {
+        const char * q = (i == count - 1) ? end : data + size * (i + 1) / count;
+        if (q < p) q = p;
+        if (q < end)
+        {
+            q = (const char *) memchr(q, '\n', end - q);
+            q = q ? q + 1 : end;
+        }
+
+        ParseChunk chunk;
+        chunk.begin = p;
+        chunk.end = q;
+        chunks.append(chunk);
+
+        p = q;
+    }
+
+    return chunks;
+}
+
+static inline const char * nextLine(const char * line, const char * end, int & len)
+{
+    const char * eol = (const char *) memchr(line, '\n', end - line);
+    if (!eol) eol = end;
+
+    len = eol - line;
+    if (len > 0 && line[len - 1] == '\r') --len;
+
+    return (eol < end) ? eol + 1 : end;
+}
+
+static void parsePdbChunk(ParseChunk & chunk)
+{
+    Interner names, residues, chains, elements;
+
+    int len;
+    for (const char * line = chunk.begin, * next; line < chunk.end; line = next)
+    {
+        next = nextLine(line, chunk.end, len);
+        if (len < 6) continue;
+
+        if (!memcmp(line, "ATOM  ", 6) || !memcmp(line, "HETATM", 6))
+        {
+            if (chunk.stopAt >= 0 || len < 54) continue;
+
+            // keep only the first alternate location
+            char altLoc = line[16];
+            if (altLoc != ' ' && altLoc != 'A' && altLoc != '1') continue;
+
+            Atom atom;
+            atom.x = parseReal(line + 30, line + 38);
+            atom.y = parseReal(line + 38, line + 46);
+            atom.z = parseReal(line + 46, line + 54);
+            atom.name = names.get(line + 12, line + 16);
+            atom.residue = residues.get(line + 17, line + 20);
+            atom.chain = chains.get(line + 21, line + 22);
+            atom.residueSeq = parseInt(line + 22, line + 26);
+
+            if (len >= 78)
+                atom.element = elements.element(line + 76, line + 78);
+            if (atom.element.isEmpty())
+            {
+                // element symbols are right-justified in the first two columns of the name
+                const char * p = (line[12] == ' ' || isdigit((uchar) line[12])) ? line + 13 : line + 12;
+                atom.element = elements.element(p, p + 1);
+            }
+
+            chunk.atoms.append(atom);
+            chunk.serials.append(parseSerial(line + 6, line + 11));
+        }
+        else if (!memcmp(line, "CONECT", 6))
+        {
+            if (len < 16) continue;
+
+            int from = parseSerial(line + 6, line + 11);
+            for (int col = 11; col + 5 <= len && col < 31; col += 5)
+            {
+                int to = parseSerial(line + col, line + col + 5);
+                if (to > 0) chunk.links.append(qMakePair(from, to));
+            }
+        }
+        else if (!memcmp(line, "ENDMDL", 6))
+        {
+            if (chunk.stopAt < 0) chunk.stopAt = chunk.atoms.count();
+        }
+    }
+}
+
+static int tokenize(const char * line, int len, QVarLengthArray<const char *, 64> & tokens)
+{
+    const char * p = line;
+    const char * end = line + len;
+    int count = 0;
+
+    while (true)
+    {
+        while (p < end && isspace((uchar) *p)) ++p;
+        if (p >= end) break;
+
+        const char * b = p;
+        const char * e;
+        if (*p == '\'' || *p == '"')
+        {
+            // a quote only closes when followed by whitespace
+            char quote = *p++;
+            b = p;
+            while (p < end && !(*p == quote && (p + 1 == end || isspace((uchar) p[1])))) ++p;
+            e = p;
+            if (p < end) ++p;
+        }
+        else
+        {
+            while (p < end && !isspace((uchar) *p)) ++p;
+            e = p;
+        }
+
+        tokens.append(b);
+        tokens.append(e);
+        ++count;
+    }
+
+    return count;
+}
+
+static inline bool cifNull(const char * b, const char * e)
+{
+    return e - b == 1 && (*b == '.' || *b == '?');
+}
+
+static void parseCifChunk(ParseChunk & chunk, const CifColumns & cols)
+{
+    Interner names, residues, chains, elements;
+    QVarLengthArray<const char *, 64> tok;
+
+    int len;
+    for (const char * line = chunk.begin, * next; line < chunk.end; line = next)
+    {
+        next = nextLine(line, chunk.end, len);
+        if (len == 0) continue;
+
+        if (line[0] == '#' || line[0] == '_' || (len >= 5 && !memcmp(line, "loop_", 5))
+                || (len >= 5 && !memcmp(line, "data_", 5)))
+        {
+            chunk.stopAt = chunk.atoms.count();
+            break;
+        }
+
+        tok.clear();
+        if (tokenize(line, len, tok) < cols.count) continue;
+
+        #define TOKEN(i) tok[2 * (i)], tok[2 * (i) + 1]
+
+        if (cols.model >= 0)
+        {
+            const char * b = tok[2 * cols.model];
+            const char * e = tok[2 * cols.model + 1];
+            if (e - b != cols.firstModel.size() || memcmp(b, cols.firstModel.constData(), e - b))
+                continue;
+        }
+
+        if (cols.altLoc >= 0)
+        {
+            const char * b = tok[2 * cols.altLoc];
+            const char * e = tok[2 * cols.altLoc + 1];
+            if (!cifNull(b, e) && *b != 'A' && *b != '1') continue;
+        }
+
+        Atom atom;
+        atom.x = parseReal(TOKEN(cols.x));
+        atom.y = parseReal(TOKEN(cols.y));
+        atom.z = parseReal(TOKEN(cols.z));
+        if (cols.name >= 0) atom.name = names.get(TOKEN(cols.name));
+        if (cols.residue >= 0) atom.residue = residues.get(TOKEN(cols.residue));
+        if (cols.chain >= 0) atom.chain = chains.get(TOKEN(cols.chain));
+        if (cols.residueSeq >= 0) atom.residueSeq = parseInt(TOKEN(cols.residueSeq));
+        if (cols.element >= 0) atom.element = elements.element(TOKEN(cols.element));
+        if (atom.element.isEmpty() && !atom.name.isEmpty())
+        {
+            const char * b = tok[2 * cols.name];
+            atom.element = elements.element(b, b + 1);
+        }
+
+        #undef TOKEN
+
+        chunk.atoms.append(atom);
+    }
+}
+
+// Intra-residue bonds of the standard residues, in heavy atoms only.
+// Hydrogens and any other atoms are attached by distance.
+static const TemplateMap & residueTemplates()
+{
+    static const char * aminoAcids[][2] = {
+        { "ALA", "" },
+        { "ARG", "CB-CG CG-CD CD-NE NE-CZ CZ-NH1 CZ=NH2" },
+        { "ASN", "CB-CG CG=OD1 CG-ND2" },
+        { "ASP", "CB-CG CG=OD1 CG-OD2" },
+        { "CYS", "CB-SG" },
+        { "GLN", "CB-CG CG-CD CD=OE1 CD-NE2" },
+        { "GLU", "CB-CG CG-CD CD=OE1 CD-OE2" },
+        { "GLY", "" },
+        { "HIS", "CB-CG CG-ND1 CG=CD2 ND1=CE1 CE1-NE2 NE2-CD2" },
+        { "ILE", "CB-CG1 CB-CG2 CG1-CD1" },
+        { "LEU", "CB-CG CG-CD1 CG-CD2" },
+        { "LYS", "CB-CG CG-CD CD-CE CE-NZ" },
+        { "MET", "CB-CG CG-SD SD-CE" },
+        { "MSE", "CB-CG CG-SE SE-CE" },
+        { "PHE", "CB-CG CG=CD1 CG-CD2 CD1-CE1 CD2=CE2 CE1=CZ CE2-CZ" },
+        { "PRO", "CB-CG CG-CD CD-N" },
+        { "SER", "CB-OG" },
+        { "THR", "CB-OG1 CB-CG2" },
+        { "TRP", "CB-CG CG=CD1 CG-CD2 CD1-NE1 NE1-CE2 CD2=CE2 CD2-CE3 CE2-CZ2 CE3=CZ3 CZ2=CH2 CZ3-CH2" },
+        { "TYR", "CB-CG CG=CD1 CG-CD2 CD1-CE1 CD2=CE2 CE1=CZ CE2-CZ CZ-OH" },
+        { "VAL", "CB-CG1 CB-CG2" },
+        { 0, 0 }
+    };
+    static const char * peptide = "N-CA CA-C C=O C-OXT CA-CB";
+
+    static const char * nucleotides[][2] = {
+        { "A",  "C1'-N9 N9-C8 C8=N7 N7-C5 C5-C6 C6=N1 N1-C2 C2=N3 N3-C4 C4=C5 C4-N9 C6-N6" },
+        { "G",  "C1'-N9 N9-C8 C8=N7 N7-C5 C5-C6 C6-N1 N1-C2 C2=N3 N3-C4 C4=C5 C4-N9 C6=O6 C2-N2" },
+        { "C",  "C1'-N1 N1-C2 C2=O2 C2-N3 N3=C4 C4-N4 C4-C5 C5=C6 C6-N1" },
+        { "U",  "C1'-N1 N1-C2 C2=O2 C2-N3 N3-C4 C4=O4 C4-C5 C5=C6 C6-N1" },
+        { "T",  "C1'-N1 N1-C2 C2=O2 C2-N3 N3-C4 C4=O4 C4-C5 C5=C6 C6-N1 C5-C7" },
+        { 0, 0 }
+    };
+    static const char * sugarPhosphate =
+        "P-OP1 P=OP2 P-O5' O5'-C5' C5'-C4' C4'-O4' C4'-C3' C3'-O3' C3'-C2' C2'-C1' C1'-O4' C2'-O2'";
+
+    static TemplateMap map;
+    if (!map.isEmpty()) return map;
+
+    struct Local
+    {
+        static void add(QVector<TemplateBond> & bonds, const char * spec)
+        {
+            foreach (QString bond, QString(spec).split(' ', QString::SkipEmptyParts))
+            {
+                int sep = bond.indexOf(QRegExp("[-=#]"));
+                TemplateBond tb;
+                tb.a = bond.left(sep);
+                tb.b = bond.mid(sep + 1);
+                tb.type = (bond[sep] == '=') ? btDouble : (bond[sep] == '#') ? btTriple : btSingle;
+                bonds.append(tb);
+            }
+        }
+    };
+
+    for (int i = 0; aminoAcids[i][0]; ++i)
+    {
+        QVector<TemplateBond> bonds;
+        Local::add(bonds, peptide);
+        Local::add(bonds, aminoAcids[i][1]);
+        map.insert(aminoAcids[i][0], bonds);
+    }
+
+    for (int i = 0; nucleotides[i][0]; ++i)
+    {
+        QVector<TemplateBond> bonds;
+        Local::add(bonds, sugarPhosphate);
+        Local::add(bonds, nucleotides[i][1]);
+        map.insert(nucleotides[i][0], bonds);
+        map.insert(QString("D") + nucleotides[i][0], bonds);
+    }
+
+    return map;
+}
+
+static inline double dist2(const Atom & a, const Atom & b)
+{
+    double dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+    return dx*dx + dy*dy + dz*dz;
+}
+
+static inline bool isHydrogen(const Atom & a)
+{
+    return a.element == "H" || a.element == "D";
+}
+
+static int findAtom(const QList<Atom> & atoms, int first, int last, const QString & name)
+{
+    for (int i = first; i < last; ++i)
+        if (atoms.at(i).name == name) return i;
+
+    return -1;
+}
+
+static void addBond(QVector<BondRec> & bonds, int a, int b, BondType type)
+{
+    BondRec rec;
+    rec.a = a;
+    rec.b = b;
+    rec.type = type;
+    bonds.append(rec);
+}
+
+// residues with more atoms than this are bonded on a grid, so that large
+// ligands or waters sharing one number do not take quadratic time
+static const int gridResidueSize = 64;
+
+// atoms of one residue binned into cells as wide as the longest bond
+struct ResidueGrid
+{
+    QHash<qint64, int> head;
+    QVector<int> next;
+    int first, last;
+    double lo[3];
+
+    static qint64 cellKey(qint64 cx, qint64 cy, qint64 cz)
+    {
+        return (cz << 40) | (cy << 20) | cx;
+    }
+
+    void cellOf(const Atom & atom, qint64 c[3]) const
+    {
+        c[0] = qint64((atom.x - lo[0]) / 1.9);
+        c[1] = qint64((atom.y - lo[1]) / 1.9);
+        c[2] = qint64((atom.z - lo[2]) / 1.9);
+    }
+
+    void build(const QList<Atom> & atoms, int first, int last)
+    {
+        this->first = first;
+        this->last = last;
+        head.clear();
+        if (last - first <= gridResidueSize) return;
+
+        lo[0] = atoms.at(first).x; lo[1] = atoms.at(first).y; lo[2] = atoms.at(first).z;
+        for (int i = first; i < last; ++i)
+        {
+            lo[0] = qMin(lo[0], atoms.at(i).x);
+            lo[1] = qMin(lo[1], atoms.at(i).y);
+            lo[2] = qMin(lo[2], atoms.at(i).z);
+        }
+
+        next.fill(-1, last - first);
+        for (int i = first; i < last; ++i)
+        {
+            qint64 c[3];
+            cellOf(atoms.at(i), c);
+            qint64 key = cellKey(c[0], c[1], c[2]);
+            next[i - first] = head.value(key, -1);
+            head.insert(key, i);
+        }
+    }
+
+    // atoms of the residue that may be within a bond length of atom i
+    void candidates(const QList<Atom> & atoms, int i, QVarLengthArray<int, 64> & out) const
+    {
+        out.clear();
+        if (head.isEmpty())
+        {
+            for (int j = first; j < last; ++j)
+                out.append(j);
+            return;
+        }
+
+        qint64 c[3];
+        cellOf(atoms.at(i), c);
+        for (qint64 dz = -1; dz <= 1; ++dz)
+        for (qint64 dy = -1; dy <= 1; ++dy)
+        for (qint64 dx = -1; dx <= 1; ++dx)
+        {
+            if (c[0] + dx < 0 || c[1] + dy < 0 || c[2] + dz < 0) continue;
+            for (int j = head.value(cellKey(c[0] + dx, c[1] + dy, c[2] + dz), -1); j >= 0; j = next[j - first])
+                out.append(j);
+        }
+    }
+};
+
+static void buildResidueBonds(BondTask & task)
+{
+    const TemplateMap & templates = residueTemplates();
+    const QList<Atom> & atoms = *task.atoms;
+    const QVector<int> & start = *task.residueStart;
+
+    const double maxBond2 = 1.9 * 1.9;
+    const double maxHBond2 = 1.3 * 1.3;
+    const double minBond2 = 0.4 * 0.4;
+
+    QVarLengthArray<bool, 64> covered;
+    QVarLengthArray<int, 64> near;
+    ResidueGrid grid;
+
+    for (int r = task.first; r < task.last; ++r)
+    {
+        int first = start[r];
+        int last = start[r + 1];
+
+        covered.resize(last - first);
+        for (int i = 0; i < covered.size(); ++i) covered[i] = false;
+
+        TemplateMap::const_iterator tmpl = templates.constFind(atoms.at(first).residue);
+        if (tmpl != templates.constEnd())
+        {
+            foreach (const TemplateBond & tb, *tmpl)
+            {
+                int a = findAtom(atoms, first, last, tb.a);
+                int b = findAtom(atoms, first, last, tb.b);
+                if (a < 0 || b < 0) continue;
+
+                addBond(task.bonds, a, b, tb.type);
+                covered[a - first] = covered[b - first] = true;
+            }
+
+            // link to the next residue of the same chain
+            if (r + 1 < start.count() - 1)
+            {
+                int nextFirst = last;
+                int nextLast = start[r + 2];
+                const Atom & next = atoms.at(nextFirst);
+                if (next.chain == atoms.at(first).chain && next.residueSeq == atoms.at(first).residueSeq + 1)
+                {
+                    int a = findAtom(atoms, first, last, "C");
+                    int b = findAtom(atoms, nextFirst, nextLast, "N");
+                    if (a < 0 || b < 0)
+                    {
+                        a = findAtom(atoms, first, last, "O3'");
+                        b = findAtom(atoms, nextFirst, nextLast, "P");
+                    }
+
+                    if (a >= 0 && b >= 0 && dist2(atoms.at(a), atoms.at(b)) < maxBond2)
+                        addBond(task.bonds, a, b, btSingle);
+                }
+            }
+        }
+
+        // everything the template does not know about goes by distance
+        bool gridBuilt = false;
+        for (int i = first; i < last; ++i)
+        {
+            if (covered[i - first]) continue;
+
+            if (!gridBuilt)
+            {
+                grid.build(atoms, first, last);
+                gridBuilt = true;
+            }
+            grid.candidates(atoms, i, near);
+
+            const Atom & atom = atoms.at(i);
+            if (isHydrogen(atom))
+            {
+                int best = -1;
+                double bestD2 = maxHBond2;
+                for (int k = 0; k < near.size(); ++k)
+                {
+                    int j = near[k];
+                    if (j == i || isHydrogen(atoms.at(j))) continue;
+
+                    double d2 = dist2(atom, atoms.at(j));
+                    if (d2 < bestD2)
+                    {
+                        best = j;
+                        bestD2 = d2;
+                    }
+                }
+
+                if (best >= 0) addBond(task.bonds, best, i, btSingle);
+            }
+            else
+            {
+                for (int k = 0; k < near.size(); ++k)
+                {
+                    int j = near[k];
+                    if (j == i || isHydrogen(atoms.at(j))) continue;
+                    if (!covered[j - first] && j < i) continue; // counted from the other end
+
+                    double d2 = dist2(atom, atoms.at(j));
+                    if (d2 > minBond2 && d2 < maxBond2)
+                        addBond(task.bonds, i, j, btSingle);
+                }
+            }
+        }
+    }
+}
+
+static inline bool sameResidue(const Atom & a, const Atom & b)
+{
+    return a.residueSeq == b.residueSeq && a.chain == b.chain && a.residue == b.residue;
+}
+
+static void mergeChunks(Molecule & molecule, QVector<ParseChunk> & chunks)
+{
+    int total = 0;
+    int used = 0;
+    for (; used < chunks.count(); ++used)
+    {
+        const ParseChunk & chunk = chunks[used];
+        total += (chunk.stopAt >= 0) ? chunk.stopAt : chunk.atoms.count();
+        if (chunk.stopAt >= 0)
+        {
+            ++used;
+            break;
+        }
+    }
+
+    QHash<int, int> serialIndex;
+    QSet<int> ambiguous; // serials that wrapped around or did not parse
+    QVector<QPair<int, int> > links;
+    foreach (const ParseChunk & chunk, chunks)
+        links += chunk.links;
+
+    molecule.atoms.reserve(total);
+    for (int c = 0; c < used; ++c)
+    {
+        const ParseChunk & chunk = chunks[c];
+        int count = (chunk.stopAt >= 0) ? chunk.stopAt : chunk.atoms.count();
+        for (int i = 0; i < count; ++i)
+        {
+            if (!links.isEmpty())
+            {
+                int serial = chunk.serials[i];
+                if (serial < 0 || serialIndex.contains(serial))
+                    ambiguous.insert(serial);
+                serialIndex.insert(serial, molecule.atoms.count());
+            }
+
+            const Atom & atom = chunk.atoms[i];
+            molecule.atoms.append(atom);
+
+            molecule.massCenterX += atom.x;
+            molecule.massCenterY += atom.y;
+            molecule.massCenterZ += atom.z;
+        }
+    }
+    chunks.clear();
+
+    if (molecule.atoms.isEmpty()) return;
+
+    molecule.massCenterX /= molecule.atoms.count();
+    molecule.massCenterY /= molecule.atoms.count();
+    molecule.massCenterZ /= molecule.atoms.count();
+
+    // residue boundaries
+    QVector<int> residueStart;
+    QVector<int> residueOf(molecule.atoms.count());
+    for (int i = 0; i < molecule.atoms.count(); ++i)
+    {
+        if (i == 0 || !sameResidue(molecule.atoms.at(i - 1), molecule.atoms.at(i)))
+            residueStart.append(i);
+        residueOf[i] = residueStart.count() - 1;
+    }
+    residueStart.append(molecule.atoms.count());
+
+    residueTemplates(); // build it before the workers start
+
+    int residueCount = residueStart.count() - 1;
+    int taskCount = qMin(residueCount, QThread::idealThreadCount() * 4);
+    QVector<BondTask> tasks(taskCount);
+    for (int i = 0; i < taskCount; ++i)
+    {
+        tasks[i].atoms = &molecule.atoms;
+        tasks[i].residueStart = &residueStart;
+        tasks[i].first = (qint64) residueCount * i / taskCount;
+        tasks[i].last = (qint64) residueCount * (i + 1) / taskCount;
+    }
+    QtConcurrent::blockingMap(tasks, buildResidueBonds);
+
+    // CONECT records list every bond from both ends; bonds within
+    // a residue are already known, and atoms whose serial is not unique
+    // cannot be told apart
+    QSet<QPair<int, int> > seen;
+    BondTask extra;
+    for (int i = 0; i < links.count(); ++i)
+    {
+        if (ambiguous.contains(links[i].first) || ambiguous.contains(links[i].second)) continue;
+
+        QHash<int, int>::const_iterator a = serialIndex.constFind(links[i].first);
+        QHash<int, int>::const_iterator b = serialIndex.constFind(links[i].second);
+        if (a == serialIndex.constEnd() || b == serialIndex.constEnd()) continue;
+        if (residueOf[*a] == residueOf[*b]) continue;
+
+        QPair<int, int> key = qMakePair(qMin(*a, *b), qMax(*a, *b));
+        if (seen.contains(key)) continue;
+        seen.insert(key);
+
+        addBond(extra.bonds, key.first, key.second, btSingle);
+    }
+    tasks.append(extra);
+
+    int bondCount = 0;
+    foreach (const BondTask & task, tasks)
+        bondCount += task.bonds.count();
+
+    molecule.bonds.reserve(bondCount);
+    foreach (const BondTask & task, tasks)
+    {
+        foreach (const BondRec & rec, task.bonds)
+        {
+            Bond bond;
+            bond.indexA = rec.a;
+            bond.indexB = rec.b;
+            bond.a = &molecule.atoms[rec.a];
+            bond.b = &molecule.atoms[rec.b];
+            bond.type = rec.type;
+            molecule.bonds.append(bond);
+        }
+    }
+}
+
+void readPdb(Molecule & molecule, const char * data, qint64 size)
+{
+    const char * end = data + size;
+
+    // title from the header records
+    int len;
+    for (const char * line = data, * next; line < end; line = next)
+    {
+        next = nextLine(line, end, len);
+        if (len >= 6 && (!memcmp(line, "ATOM  ", 6) || !memcmp(line, "HETATM", 6))) break;
+
+        if (len > 10 && (!memcmp(line, "HEADER", 6) || !memcmp(line, "TITLE ", 6)))
+        {
+            QString text = QString::fromLatin1(line + 10, len - 10).trimmed();
+            if (line[0] == 'H') molecule.comment = text;
+            else if (molecule.name.isEmpty()) molecule.name = text;
+        }
+    }
+
+    QVector<ParseChunk> chunks = splitLines(data, end);
+    QtConcurrent::blockingMap(chunks, parsePdbChunk);
+    mergeChunks(molecule, chunks);
+}
+
+struct CifChunkParser
+{
+    const CifColumns & cols;
+
+    CifChunkParser(const CifColumns & cols) : cols(cols) {}
+
+    typedef void result_type;
+    void operator()(ParseChunk & chunk) { parseCifChunk(chunk, cols); }
+};
+
+// Parses the atom_site loop header; returns the start of its rows,
+// or 0 if the buffer does not contain the complete header.
+static const char * readCifHeader(const char * data, const char * end, CifColumns & cols, QString & name)
+{
+    const char * line = data;
+    const char * next;
+    int len;
+
+    QStringList columns;
+    for (; line < end; line = next)
+    {
+        next = nextLine(line, end, len);
+
+        if (len > 5 && !memcmp(line, "data_", 5) && name.isEmpty())
+            name = QString::fromLatin1(line + 5, len - 5).trimmed();
+
+        if (len > 11 && !memcmp(line, "_atom_site.", 11))
+        {
+            const char * b = line + 11;
+            const char * e = line + len;
+            trim(b, e);
+            columns.append(QString::fromLatin1(b, e - b));
+        }
+        else if (!columns.isEmpty())
+            break;
+    }
+
+    if (columns.isEmpty() || line >= end) return 0;
+
+    cols.count = columns.count();
+    cols.x = columns.indexOf("Cartn_x");
+    cols.y = columns.indexOf("Cartn_y");
+    cols.z = columns.indexOf("Cartn_z");
+    cols.element = columns.indexOf("type_symbol");
+    cols.name = columns.indexOf("auth_atom_id");
+    if (cols.name < 0) cols.name = columns.indexOf("label_atom_id");
+    cols.residue = columns.indexOf("auth_comp_id");
+    if (cols.residue < 0) cols.residue = columns.indexOf("label_comp_id");
+    cols.chain = columns.indexOf("auth_asym_id");
+    if (cols.chain < 0) cols.chain = columns.indexOf("label_asym_id");
+    cols.residueSeq = columns.indexOf("auth_seq_id");
+    if (cols.residueSeq < 0) cols.residueSeq = columns.indexOf("label_seq_id");
+    cols.altLoc = columns.indexOf("label_alt_id");
+    cols.model = columns.indexOf("pdbx_PDB_model_num");
+
+    if (cols.x < 0 || cols.y < 0 || cols.z < 0) return 0;
+
+    // the first data row decides which model is kept
+    if (cols.model >= 0)
+    {
+        QVarLengthArray<const char *, 64> tok;
+        nextLine(line, end, len);
+        if (tokenize(line, len, tok) > cols.model)
+            cols.firstModel = QByteArray(tok[2 * cols.model], tok[2 * cols.model + 1] - tok[2 * cols.model]);
+    }
+
+    return line;
+}
+
+void readCif(Molecule & molecule, const char * data, qint64 size)
+{
+    const char * end = data + size;
+
+    CifColumns cols;
+    const char * rows = readCifHeader(data, end, cols, molecule.name);
+    if (!rows) return;
+
+    QVector<ParseChunk> chunks = splitLines(rows, end);
+    QtConcurrent::blockingMap(chunks, CifChunkParser(cols));
+    mergeChunks(molecule, chunks);
+}
+
+bool streamAtoms(QIODevice & dev, bool cif, AtomSink & sink)
+{
+    const qint64 blockSize = 16 << 20;
+    const qint64 maxCarry = 4 * blockSize;
+
+    CifColumns cols;
+    bool haveHeader = !cif;
+    QString name;
+    QByteArray carry;
+
+    while (true)
+    {
+        QByteArray block = carry + dev.read(blockSize);
+        bool last = dev.atEnd() || block.size() == carry.size();
+
+        int cut = last ? block.size() : block.lastIndexOf('\n') + 1;
+        if (cut <= 0)
+        {
+            if (block.size() > maxCarry) return false;
+            carry = block;
+            continue;
+        }
+
+        const char * data = block.constData();
+        const char * end = data + cut;
+
+        if (!haveHeader)
+        {
+            const char * rows = readCifHeader(data, end, cols, name);
+            if (!rows)
+            {
+                if (last) return true;
+                if (block.size() > maxCarry) return false;
+                carry = block; // header continues in the next block
+                continue;
+            }
+
+            haveHeader = true;
+            data = rows;
+        }
+
+        carry = block.mid(cut);
+
+        QVector<ParseChunk> chunks = splitLines(data, end);
+        if (cif)
+            QtConcurrent::blockingMap(chunks, CifChunkParser(cols));
+        else
+            QtConcurrent::blockingMap(chunks, parsePdbChunk);
+
+        foreach (const ParseChunk & chunk, chunks)
+        {
+            if (chunk.stopAt >= 0)
+            {
+                QVector<Atom> head = chunk.atoms;
+                head.resize(chunk.stopAt);
+                sink.atoms(head);
+                return true;
+            }
+            sink.atoms(chunk.atoms);
+        }
+
+        if (last) return true;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef PDB_H
+#define PDB_H
+
+#include <QVector>
+#include <QIODevice>
+#include "molecule.h"
+
+// Both readers split the buffer into line-aligned chunks which are parsed
+// concurrently and merged into the molecule in file order. Only the first
+// model is read. Bonds come from standard residue templates, CONECT records
+// and, for unknown residues and hydrogens, from interatomic distances.
+void readPdb(Molecule & molecule, const char * data, qint64 size);
+void readCif(Molecule & molecule, const char * data, qint64 size);
+
+class AtomSink
+{
+public:
+    virtual ~AtomSink() {}
+    virtual void atoms(const QVector<Atom> & atoms) = 0;
+};
+
+// Reads a PDB or mmCIF file block by block and hands the atoms of the first
+// model to the sink in file order, without holding the whole structure.
+// No bonds are built. Returns false when no mmCIF atom table or line end
+// turns up within a few blocks, as the file is then not what it claims.
+bool streamAtoms(QIODevice & dev, bool cif, AtomSink & sink);
+
+#endif // PDB_H
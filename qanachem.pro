@@ -1,16 +1,32 @@
 # -------------------------------------------------
 # Project created by QtCreator 2010-09-28T18:22:25
 # -------------------------------------------------
-QT += opengl
+QT += opengl network
 TARGET = qanachem
 TEMPLATE = app
-LIBS += -lglut
+LIBS += -lglut -lz -lzstd
 SOURCES += main.cpp \
     mainwindow.cpp \
     glwidget.cpp \
-    molecule.cpp
+    molecule.cpp \
+    pdb.cpp \
+    decompress.cpp \
+    renderserver.cpp \
+    embed.cpp \
+    brickstore.cpp \
+    bondframes.cpp \
+    moleculecache.cpp \
+    camerapath.cpp
 HEADERS += mainwindow.h \
     glwidget.h \
-    molecule.h
+    molecule.h \
+    pdb.h \
+    decompress.h \
+    renderserver.h \
+    embed.h \
+    brickstore.h \
+    bondframes.h \
+    moleculecache.h \
+    camerapath.h
 FORMS += mainwindow.ui
 RESOURCES += resources.qrc
@@ -0,0 +1,318 @@
+#include "renderserver.h"
+#include "glwidget.h"
+#include "moleculecache.h"
+#include "decompress.h"
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QBuffer>
+#include <QFile>
+#include <QTimer>
+#include <QImage>
+#include <QStringList>
+#include <QElapsedTimer>
+#include <QtAlgorithms>
+#include <ctime>
+
+ViewState::ViewState()
+{
+    xRot = yRot = zRot = 0;
+    scale = 100;
+    eyeDistance = 100;
+    atomSize = 25;
+    moleculeSize = 0;
+    anaglyph = true;
+    format = "png";
+    quality = -1;
+}
+
+// CPU time of the calling thread; the pool threads that parse and
+// decompress files do not count towards the frames
+static double threadCpuSeconds()
+{
+#ifdef Q_OS_LINUX
+    timespec t;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t) == 0)
+        return t.tv_sec + t.tv_nsec / 1.0e9;
+#endif
+    return double(clock()) / CLOCKS_PER_SEC;
+}
+
+QString ViewState::key() const
+{
+    // the path goes last and is not run through arg(), so that any '|'
+    // or '%1' in it cannot make two views look alike
+    QStringList fields;
+    fields << QString::number(xRot) << QString::number(yRot) << QString::number(zRot)
+        << QString::number(scale) << QString::number(eyeDistance)
+        << QString::number(atomSize) << QString::number(moleculeSize)
+        << QString::number(anaglyph) << QString(format) << QString::number(quality)
+        << molecule;
+    return fields.join("|");
+}
+
+RenderServer::RenderServer(GLWidget * display, QObject * parent)
+    : QObject(parent)
+{
+    this->display = display;
+    tcp = 0;
+    local = 0;
+    batchScheduled = false;
+
+    frames = 0;
+    totalMs = maxMs = 0;
+    cpuStart = threadCpuSeconds();
+
+    molecules = new MoleculeCache(qint64(256) << 20, this);
+    defaultMolecule = display->getMolecule();
+}
+
+void RenderServer::setCacheBudget(int megabytes)
+{
+    molecules->setBudget(qint64(megabytes) << 20);
+    display->setSceneBudget(megabytes);
+}
+
+// the molecule of a file, parsed again if it dropped out of the cache;
+// the stamp is taken by the caller before any parsing
+bool RenderServer::loadMolecule(const QString & fname, const QString & stamp, Molecule & molecule)
+{
+    if (fname.isEmpty())
+    {
+        molecule = defaultMolecule;
+        return true;
+    }
+    if (molecules->lookup(fname, molecule))
+        return true;
+
+    try {
+        molecule = Molecule(fname);
+    } catch (...) {
+        return false;
+    }
+    molecules->insert(fname, molecule, stamp);
+    return true;
+}
+
+bool RenderServer::listen(const QString & address)
+{
+    if (address.startsWith("tcp:"))
+    {
+        tcp = new QTcpServer(this);
+        connect(tcp, SIGNAL(newConnection()), this, SLOT(acceptTcp()));
+        return tcp->listen(QHostAddress::LocalHost, address.mid(4).toInt());
+    }
+
+    if (address.startsWith("unix:"))
+    {
+        QString name = address.mid(5);
+        QLocalServer::removeServer(name);
+
+        local = new QLocalServer(this);
+        connect(local, SIGNAL(newConnection()), this, SLOT(acceptLocal()));
+        return local->listen(name);
+    }
+
+    return false;
+}
+
+void RenderServer::acceptTcp()
+{
+    while (tcp->hasPendingConnections())
+    {
+        QTcpSocket * socket = tcp->nextPendingConnection();
+        socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+        addClient(socket);
+    }
+}
+
+void RenderServer::acceptLocal()
+{
+    while (local->hasPendingConnections())
+        addClient(local->nextPendingConnection());
+}
+
+void RenderServer::addClient(QIODevice * socket)
+{
+    clients.insert(socket, ViewState());
+    connect(socket, SIGNAL(readyRead()), this, SLOT(readClient()));
+    connect(socket, SIGNAL(disconnected()), this, SLOT(dropClient()));
+}
+
+void RenderServer::dropClient()
+{
+    QIODevice * socket = qobject_cast<QIODevice *>(sender());
+    clients.remove(socket);
+    pending.removeAll(socket);
+    socket->deleteLater();
+}
+
+void RenderServer::readClient()
+{
+    QIODevice * socket = qobject_cast<QIODevice *>(sender());
+    if (!pending.contains(socket))
+        pending.append(socket);
+
+    // let the other clients' requests of this event loop pass join the batch
+    if (!batchScheduled)
+    {
+        batchScheduled = true;
+        QTimer::singleShot(0, this, SLOT(processBatch()));
+    }
+}
+
+void RenderServer::execute(QIODevice * client, const QByteArray & line, QList<FrameRequest> & frames)
+{
+    QList<QByteArray> args = line.simplified().split(' ');
+    QByteArray cmd = args[0];
+    int value = (args.count() > 1) ? args[1].toInt() : 0;
+    ViewState & state = clients[client];
+
+    if (cmd.isEmpty())
+        return;
+    else if (cmd == "load" && args.count() > 1)
+    {
+        QString fname = QString::fromLocal8Bit(line.simplified().mid(5));
+        if (!QFile::exists(fname))
+        {
+            client->write("ERR cannot open " + fname.toLocal8Bit() + "\n");
+            return;
+        }
+
+        Molecule molecule;
+        if (!loadMolecule(fname, fileStamp(fname), molecule))
+        {
+            client->write("ERR cannot load " + fname.toLocal8Bit() + "\n");
+            return;
+        }
+        state.molecule = fname;
+    }
+    else if (cmd == "xrot") state.xRot = value;
+    else if (cmd == "yrot") state.yRot = value;
+    else if (cmd == "zrot") state.zRot = value;
+    else if (cmd == "scale") state.scale = value;
+    else if (cmd == "eye") state.eyeDistance = value;
+    else if (cmd == "atoms") state.atomSize = value;
+    else if (cmd == "size") state.moleculeSize = qBound(0, value, 2);
+    else if (cmd == "anaglyph") state.anaglyph = value;
+    else if (cmd == "format" && args.count() > 1)
+    {
+        state.format = (args[1] == "jpg" || args[1] == "jpeg") ? "jpg" : "png";
+        state.quality = (args.count() > 2) ? args[2].toInt() : -1;
+    }
+    else if (cmd == "frame" && args.count() > 2)
+    {
+        FrameRequest frame;
+        frame.client = client;
+        frame.state = state;
+        frame.width = qBound(1, value, 4096);
+        frame.height = qBound(1, args[2].toInt(), 4096);
+        frames.append(frame);
+    }
+    else if (cmd == "stats")
+    {
+        double cpu = threadCpuSeconds() - cpuStart;
+        client->write(QString("STATS frames %1 mean_ms %2 max_ms %3 fps_per_core %4\n")
+            .arg(this->frames)
+            .arg(this->frames ? totalMs / this->frames : 0, 0, 'f', 2)
+            .arg(maxMs, 0, 'f', 2)
+            .arg(cpu > 0 ? this->frames / cpu : 0, 0, 'f', 1).toAscii());
+    }
+    else if (cmd == "quit")
+        client->close();
+    else
+        client->write("ERR unknown command " + cmd + "\n");
+}
+
+// Only the knobs that differ from the last frame are touched, since
+// some of them recompile the display list.
+void RenderServer::apply(const ViewState & state)
+{
+    // the display keeps the lists of the molecules switched away from,
+    // under the file's stamp so that a changed file is compiled afresh
+    if (state.molecule != current.molecule)
+    {
+        QString stamp = fileStamp(state.molecule);
+        QString key = "serve:" + stamp + "|" + state.molecule;
+        if (!display->showScene(key))
+        {
+            Molecule molecule;
+            loadMolecule(state.molecule, stamp, molecule);
+            display->setMolecule(molecule, key);
+        }
+    }
+    if (state.moleculeSize != current.moleculeSize)
+        display->setMoleculeSize(state.moleculeSize);
+    if (state.atomSize != current.atomSize)
+        display->setAtomSizeScale(state.atomSize);
+    if (state.anaglyph != current.anaglyph)
+        display->setAnaglyph(state.anaglyph);
+
+    display->setXRot(state.xRot);
+    display->setYRot(state.yRot);
+    display->setZRot(state.zRot);
+    display->setScale(state.scale);
+    display->setEyeDistance(state.eyeDistance);
+
+    current = state;
+}
+
+static bool byMolecule(const QPair<QString, int> & a, const QPair<QString, int> & b)
+{
+    return a.first < b.first;
+}
+
+void RenderServer::processBatch()
+{
+    batchScheduled = false;
+
+    QList<FrameRequest> requests;
+    foreach (QIODevice * client, pending)
+    {
+        while (client->canReadLine())
+            execute(client, client->readLine(), requests);
+    }
+    pending.clear();
+
+    // render the current molecule first, then the others one by one
+    QList<QPair<QString, int> > order;
+    for (int i = 0; i < requests.count(); ++i)
+    {
+        QString m = requests[i].state.molecule;
+        order.append(qMakePair((m == current.molecule ? "0" : "1") + m, i));
+    }
+    qStableSort(order.begin(), order.end(), byMolecule);
+
+    QHash<QString, QByteArray> encoded;
+    for (int i = 0; i < order.count(); ++i)
+    {
+        const FrameRequest & frame = requests[order[i].second];
+        if (!clients.contains(frame.client)) continue;
+
+        // each request is timed on its own, not behind the ones before it
+        QElapsedTimer timer;
+        timer.start();
+
+        QString key = QString("%1x%2|").arg(frame.width).arg(frame.height) + frame.state.key();
+        if (!encoded.contains(key))
+        {
+            apply(frame.state);
+            QImage image = display->renderFrame(frame.width, frame.height);
+
+            QBuffer buffer;
+            buffer.open(QIODevice::WriteOnly);
+            image.save(&buffer, frame.state.format.constData(), frame.state.quality);
+            encoded.insert(key, buffer.data());
+        }
+
+        const QByteArray & data = encoded[key];
+        double ms = timer.nsecsElapsed() / 1.0e6;
+        frame.client->write(QString("FRAME %1 %2\n").arg(data.size()).arg(ms).toAscii());
+        frame.client->write(data);
+
+        ++frames;
+        totalMs += ms;
+        maxMs = qMax(maxMs, ms);
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef RENDERSERVER_H
+#define RENDERSERVER_H
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+
+#include "molecule.h"
+
+class GLWidget;
+class MoleculeCache;
+class QTcpServer;
+class QLocalServer;
+class QIODevice;
+
+// Per-client view state, as set by the commands of the protocol.
+struct ViewState
+{
+    QString molecule; // empty = the default molecule
+    int xRot, yRot, zRot;
+    int scale, eyeDistance, atomSize, moleculeSize;
+    bool anaglyph;
+    QByteArray format;
+    int quality;
+
+    ViewState();
+    QString key() const;
+};
+
+// Line-based protocol over TCP or a Unix socket:
+//   load <path> | xrot|yrot|zrot <deg> | scale <%> | eye <dist> | atoms <%>
+//   size 0|1|2 | anaglyph 0|1 | format png|jpg [quality]
+//   frame <width> <height>  -> "FRAME <bytes> <ms>\n" + image data, where ms
+//                              is the time spent on this request alone
+//   stats                   -> "STATS frames <n> mean_ms <x> max_ms <x> fps_per_core <x>"
+// Commands that arrive together are handled as one batch: frames are
+// grouped by molecule so the display list is compiled once per batch,
+// and identical requests share one rendered image.
+class RenderServer : public QObject
+{
+Q_OBJECT
+
+    struct FrameRequest
+    {
+        QIODevice * client;
+        ViewState state;
+        int width, height;
+    };
+
+    GLWidget * display;
+    QTcpServer * tcp;
+    QLocalServer * local;
+
+    QHash<QIODevice *, ViewState> clients;
+    QList<QIODevice *> pending;
+    bool batchScheduled;
+
+    MoleculeCache * molecules; // loaded files, within the cache budget
+    Molecule defaultMolecule;
+    ViewState current;
+
+    int frames;
+    double totalMs, maxMs;
+    double cpuStart; // of the serving thread only
+
+    void addClient(QIODevice * socket);
+    bool loadMolecule(const QString & fname, const QString & stamp, Molecule & molecule);
+    void execute(QIODevice * client, const QByteArray & line, QList<FrameRequest> & frames);
+    void apply(const ViewState & state);
+
+public:
+    explicit RenderServer(GLWidget * display, QObject * parent = 0);
+
+    // "tcp:<port>" or "unix:<name>"
+    bool listen(const QString & address);
+
+    // memory for loaded molecules, and again for their display lists
+    void setCacheBudget(int megabytes);
+
+private slots:
+    void acceptTcp();
+    void acceptLocal();
+    void readClient();
+    void dropClient();
+    void processBatch();
+};
+
+#endif // RENDERSERVER_H